@@ -73,6 +73,11 @@
  
 #define FUSE_USE_VERSION 26
 #include "utils.h"
+#include "tar.h"
+#include "sched.h"
+#include "nodetable.h"
+#include <stddef.h>
+#include <fuse_opt.h>
 
 using namespace std;
 
@@ -82,11 +87,90 @@ queue<string> adb_push(const string, const string);
 queue<string> adb_pull(const string, const string);
 queue<string> adb_shell(const string);
 queue<string> shell(const string);
+bool parse_stat(const queue<string>&, nodeAttr&);
 void clearTmpDir();
 
-map<string,fileCache> fileData;
 map<int,bool> filePendingWrite;
-map<string,bool> fileTruncated;
+
+/**
+   Everything known about device paths: attributes, directory
+   listings and the state of local copies.  Guarded by nodeLock.
+ */
+nodeTable nodes;
+pthread_mutex_t nodeLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+   Subtrees brought in with bulk_import.  Writes below them are kept
+   locally until the next bulk_export instead of being pushed one by
+   one.  Guarded by nodeLock.
+ */
+set<string> bulkRoots;
+
+/**
+   Path of the control file.  It does not appear in directory
+   listings.  Writing "import DIR", "export [DIR]" or "copy SRC DST"
+   to it runs bulk_import, bulk_export or device_copy; reading it
+   returns the outcome of the last command.
+ */
+#define CONTROL_PATH "/.adbfs_control"
+
+/** Outcome of the last control command; guarded by controlLock. */
+string controlStatus;
+pthread_mutex_t controlLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+   State of a streaming upload for one open file handle.  Strictly
+   sequential writes are forwarded to a device-side writer as they
+   arrive; anything else stops the stream and the staged local copy
+   is pushed on flush as usual.
+ */
+struct uploadStream {
+    pthread_mutex_t lock;
+    FILE *pipe;     // stdin of the device-side writer, NULL once closed
+    off_t next;     // offset at which the next sequential write starts
+    bool failed;    // stream is incomplete, push the local copy instead
+};
+
+map<int,uploadStream*> fileUpload;
+pthread_mutex_t fileUploadLock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+   Settings given with -o on the command line.
+ */
+struct adbfs_config {
+    int verbose;
+    int trace;
+    char *trace_file;
+    int stream_writes;
+    int bulk_ttl;
+    int interactive_slots;
+    int bulk_slots;
+    int bulk_chunk;
+    int max_nodes;
+    int stripes;
+    int stripe_size;
+    int stripe_verify;
+};
+
+static struct adbfs_config conf;
+
+#define ADBFS_OPT(t, p, v) { t, offsetof(struct adbfs_config, p), v }
+
+static struct fuse_opt adbfs_opts[] = {
+    ADBFS_OPT("verbose=%d", verbose, 0),
+    ADBFS_OPT("trace", trace, 1),
+    ADBFS_OPT("trace_file=%s", trace_file, 0),
+    ADBFS_OPT("stream_writes", stream_writes, 1),
+    ADBFS_OPT("bulk_ttl=%d", bulk_ttl, 0),
+    ADBFS_OPT("interactive_slots=%d", interactive_slots, 0),
+    ADBFS_OPT("bulk_slots=%d", bulk_slots, 0),
+    ADBFS_OPT("bulk_chunk=%d", bulk_chunk, 0),
+    ADBFS_OPT("max_nodes=%d", max_nodes, 0),
+    ADBFS_OPT("stripes=%d", stripes, 0),
+    ADBFS_OPT("stripe_size=%d", stripe_size, 0),
+    ADBFS_OPT("stripe_verify", stripe_verify, 1),
+    FUSE_OPT_END
+};
 
 /**
    Return the result of executing the given command string, using
@@ -120,6 +204,7 @@ queue<string> adb_shell(const string command)
     actual_command.assign(command);
     adb_shell_escape_command(actual_command);
     actual_command.insert(0, "adb shell busybox ");
+    ioSlot slot(IO_INTERACTIVE);
     return exec_command(actual_command);
 }
 
@@ -212,6 +297,33 @@ void adb_push_pull_cmd(string& cmd, const bool push,
     cmd.append("'");
 }
 
+/**
+   Return the size of a file on the local host, or -1 if it cannot be
+   determined.  Used for transfer byte counts in traces.
+
+   @param local_path path on the local host.
+ */
+long long local_file_size(const string local_path)
+{
+    struct stat st;
+    if (stat(local_path.c_str(), &st) == -1)
+        return -1;
+    return st.st_size;
+}
+
+/**
+   Return the size of a device file according to stat, or -1 if it
+   does not exist.  adb exec-in does not report the exit status of
+   the device-side command, so this is how uploads are checked.
+ */
+long long remote_file_size(const string path)
+{
+    nodeAttr attr;
+    if (!parse_stat(adb_shell("stat -t \"" + path + "\""), attr))
+        return -1;
+    return attr.size;
+}
+
 /**
    Copy (using adb pull) a file from the Android device to the local
    host.
@@ -227,9 +339,13 @@ void adb_push_pull_cmd(string& cmd, const bool push,
 queue<string> adb_pull(const string remote_source,
 		       const string local_destination)
 {
+    traceScope trace("xfer", "pull", remote_source.c_str());
+    ioSlot slot(IO_BULK);
     string cmd;
     adb_push_pull_cmd(cmd, false, local_destination, remote_source);
-    return exec_command(cmd);
+    queue<string> output = exec_command(cmd);
+    trace.set_bytes(local_file_size(local_destination));
+    return output;
 }
 
 /**
@@ -243,40 +359,728 @@ queue<string> adb_pull(const string remote_source,
 queue<string> adb_push(const string local_source,
 		       const string remote_destination)
 {
+    traceScope trace("xfer", "push", remote_destination.c_str());
+    trace.set_bytes(local_file_size(local_source));
+    ioSlot slot(IO_BULK);
     string cmd;
     adb_push_pull_cmd(cmd, true, local_source, remote_destination);
     return exec_command(cmd);
 }
 
 /**
-   adbFS implementation of FUSE interface function fuse_operations.getattr.
-   @todo check shell escaping.
+   Copy everything from in to out, giving the bulk slot to waiting
+   interactive work every bulk_chunk bytes.  Pausing the copy stalls
+   the adb stream behind it, which frees the link.
+
+   @param in source stream, e.g. adb exec-out output.
+   @param out destination stream, e.g. adb exec-in input.
+   @param slot bulk slot held by the caller.
+   @return number of bytes copied, or -1 on a write error.
  */
-static int adb_getattr(const char *path, struct stat *stbuf)
+long long copy_chunked(FILE *in, FILE *out, ioSlot &slot)
+{
+    char buf[65536];
+    long long copied = 0;
+    long long chunk_end = conf.bulk_chunk;
+    size_t n;
+    while ((n = fread(buf, 1, sizeof buf, in)) > 0) {
+        if (fwrite(buf, 1, n, out) != n)
+            return -1;
+        copied += n;
+        if (copied >= chunk_end) {
+            slot.yield();
+            chunk_end = copied + conf.bulk_chunk;
+        }
+    }
+    return copied;
+}
+
+/** Block size of the ranged reads; stripe_size is a multiple of it. */
+#define STRIPE_BLOCK 65536
+
+/** How often a stripe that arrived short is fetched again. */
+#define STRIPE_RETRIES 2
+
+/**
+   A striped fetch in progress, shared by its worker threads.
+ */
+struct stripeJob {
+    pthread_mutex_t lock;
+    string remote_source;
+    int fd;             // local copy, written with pwrite
+    long long size;
+    long long next;     // offset of the next stripe to hand out
+    bool failed;
+};
+
+/**
+   Fetch the stripe [offset, offset + length) of a file with a ranged
+   dd on the device and write it at its offset into the local copy.
+
+   @return true if exactly length bytes arrived.
+ */
+bool fetch_stripe(stripeJob &job, const long long offset, const long long length)
+{
+    traceScope trace("xfer", "stripe", job.remote_source.c_str());
+    ioSlot slot(IO_BULK);
+    char range[100];
+    snprintf(range, sizeof range, "\" bs=%d skip=%lld count=%lld 2>/dev/null'",
+             STRIPE_BLOCK, offset / STRIPE_BLOCK,
+             (length + STRIPE_BLOCK - 1) / STRIPE_BLOCK);
+    string cmd = "adb exec-out 'busybox dd if=\"";
+    cmd.append(job.remote_source);
+    cmd.append(range);
+    FILE *in = exec_command_stream(cmd, "r");
+    if (in == NULL)
+        return false;
+
+    char buf[STRIPE_BLOCK];
+    long long copied = 0;
+    long long chunk_end = conf.bulk_chunk;
+    bool ok = true;
+    size_t n;
+    while (ok && (n = fread(buf, 1, sizeof buf, in)) > 0) {
+        if (copied + (long long) n > length
+            || pwrite(job.fd, buf, n, offset + copied) != (ssize_t) n)
+            ok = false;
+        copied += n;
+        if (copied >= chunk_end) {
+            slot.yield();
+            chunk_end = copied + conf.bulk_chunk;
+        }
+    }
+    if (pclose(in) != 0)
+        ok = false;
+    trace.set_bytes(copied);
+    return ok && copied == length;
+}
+
+/**
+   Worker thread of adb_fetch_striped: takes stripes in file order
+   until none are left or one could not be fetched.
+ */
+static void *stripe_worker(void *arg)
+{
+    stripeJob &job = *(stripeJob*) arg;
+    for (;;) {
+        pthread_mutex_lock(&job.lock);
+        long long offset = job.next;
+        bool done = job.failed || offset >= job.size;
+        job.next += conf.stripe_size;
+        pthread_mutex_unlock(&job.lock);
+        if (done)
+            break;
+
+        long long length = min((long long) conf.stripe_size, job.size - offset);
+        bool ok = fetch_stripe(job, offset, length);
+        for (int retry = 0; !ok && retry < STRIPE_RETRIES; ++retry) {
+            TRACE_INSTANT("xfer", "stripe_retry", job.remote_source.c_str(), offset);
+            ok = fetch_stripe(job, offset, length);
+        }
+        if (!ok) {
+            pthread_mutex_lock(&job.lock);
+            job.failed = true;
+            pthread_mutex_unlock(&job.lock);
+        }
+    }
+    return NULL;
+}
+
+/**
+   Return true if a local file has the same MD5 sum as a device file.
+ */
+bool same_md5(const string remote_path, const string local_path)
+{
+    queue<string> device;
+    {
+        // Hashing a large file takes as long as reading it, so it
+        // counts as a transfer; adb_shell reuses this slot.
+        ioSlot slot(IO_BULK);
+        device = adb_shell("md5sum \"" + remote_path + "\"");
+    }
+    queue<string> host = exec_command("md5sum \"" + local_path + "\"");
+    if (device.empty() || host.empty())
+        return false;
+    string device_sum = device.front().substr(0, 32);
+    return device_sum.size() == 32 && device_sum == host.front().substr(0, 32);
+}
+
+/**
+   Copy a large file from the Android device to the local host as
+   stripes of stripe_size bytes, fetched over up to "stripes"
+   concurrent adb connections.  Each stripe must arrive complete and
+   is fetched again otherwise; the assembled copy must have the size
+   given by stat and, with stripe_verify, the MD5 sum of the device
+   file.
+
+   @param remote_source Android-side file path to copy.
+   @param local_destination local host-side destination path.
+   @param size size of the file according to stat.
+   @return true if the local copy is complete.
+ */
+bool adb_fetch_striped(const string remote_source, const string local_destination,
+                       const long long size)
+{
+    traceScope trace("xfer", "pull_striped", remote_source.c_str());
+    stripeJob job;
+    pthread_mutex_init(&job.lock, NULL);
+    job.remote_source = remote_source;
+    job.size = size;
+    job.next = 0;
+    job.failed = false;
+    job.fd = open(local_destination.c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    bool ok = job.fd != -1 && ftruncate(job.fd, size) == 0;
+
+    long long count = (size + conf.stripe_size - 1) / conf.stripe_size;
+    vector<pthread_t> workers;
+    for (long long i = 0; ok && i < conf.stripes && i < count; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, stripe_worker, &job) == 0)
+            workers.push_back(thread);
+    }
+    for (size_t i = 0; i < workers.size(); ++i)
+        pthread_join(workers[i], NULL);
+    if (workers.empty() || job.failed)
+        ok = false;
+    if (job.fd != -1 && close(job.fd) != 0)
+        ok = false;
+    pthread_mutex_destroy(&job.lock);
+
+    if (ok && local_file_size(local_destination) != size)
+        ok = false;
+    if (ok && conf.stripe_verify && !same_md5(remote_source, local_destination)) {
+        TRACE_INSTANT("xfer", "stripe_checksum_mismatch", remote_source.c_str(), size);
+        ok = false;
+    }
+    trace.set_bytes(ok ? size : -1);
+    VLOG(1) << "striped fetch of " << remote_source << " in " << count
+            << " stripes: " << (ok ? "ok" : "failed") << "\n";
+    return ok;
+}
+
+/**
+   Copy a file from the Android device to the local host.  Files
+   larger than one stripe are fetched in parallel stripes when the
+   stripes option allows it.  Files larger than one bulk chunk are
+   streamed with adb exec-out so that interactive commands can run
+   between chunks; if that fails, and for smaller files, adb pull is
+   used.
+
+   @param remote_source Android-side file path to copy.
+   @param local_destination local host-side destination path.
+   @param size size of the file according to stat.
+   @return true if the local copy has the given size afterwards.
+   @see adb_pull.
+ */
+bool adb_fetch(const string remote_source, const string local_destination,
+	       const long long size)
+{
+    if (conf.stripes > 1 && size > conf.stripe_size) {
+        if (adb_fetch_striped(remote_source, local_destination, size))
+            return true;
+        TRACE_INSTANT("xfer", "pull_striped_failed", remote_source.c_str(), size);
+    }
+    if (size > conf.bulk_chunk) {
+        traceScope trace("xfer", "pull_chunked", remote_source.c_str());
+        ioSlot slot(IO_BULK);
+        string cmd = "adb exec-out 'busybox cat \"";
+        cmd.append(remote_source);
+        cmd.append("\"'");
+        FILE *in = exec_command_stream(cmd, "r");
+        FILE *out = fopen(local_destination.c_str(), "w");
+        long long copied = -1;
+        if (in != NULL && out != NULL)
+            copied = copy_chunked(in, out, slot);
+        if (out != NULL && fclose(out) != 0)
+            copied = -1;
+        if (in != NULL && pclose(in) != 0)
+            copied = -1;
+        trace.set_bytes(copied);
+        if (copied == size)
+            return true;
+        TRACE_INSTANT("xfer", "pull_chunked_failed", remote_source.c_str(), copied);
+    }
+    adb_pull(remote_source, local_destination);
+    return local_file_size(local_destination) == size;
+}
+
+/**
+   Copy a file from the local host to the Android device, the
+   counterpart of adb_fetch: large files are streamed with adb
+   exec-in in chunks, falling back to adb push.
+
+   @param local_source local host-side file path to copy.
+   @param remote_destination Android-side destination path.
+   @see adb_push.
+ */
+void adb_send(const string local_source, const string remote_destination)
+{
+    long long size = local_file_size(local_source);
+    if (size > conf.bulk_chunk) {
+        traceScope trace("xfer", "push_chunked", remote_destination.c_str());
+        ioSlot slot(IO_BULK);
+        string cmd = "adb exec-in 'busybox cat > \"";
+        cmd.append(remote_destination);
+        cmd.append("\"'");
+        FILE *in = fopen(local_source.c_str(), "r");
+        FILE *out = in != NULL ? exec_command_stream(cmd, "w") : NULL;
+        long long copied = -1;
+        if (out != NULL)
+            copied = copy_chunked(in, out, slot);
+        if (out != NULL && pclose(out) != 0)
+            copied = -1;
+        if (in != NULL)
+            fclose(in);
+        trace.set_bytes(copied);
+        // copied only counts what went into the local pipe.
+        if (copied == size && remote_file_size(remote_destination) == size)
+            return;
+        TRACE_INSTANT("xfer", "push_chunked_failed", remote_destination.c_str(), copied);
+    }
+    adb_push(local_source, remote_destination);
+}
+
+/**
+   Start streaming an upload of the file open on local descriptor fd
+   to the given device path.  The device-side writer is "cat" run
+   through adb exec-in, which passes binary data through unchanged.
+
+   @param fd local descriptor of the staged copy.
+   @param remote_destination Android-side file path to write.
+   @see upload_write.
+   @see upload_finish.
+ */
+void upload_start(const int fd, const string remote_destination)
+{
+    string cmd = "adb exec-in 'busybox cat > \"";
+    cmd.append(remote_destination);
+    cmd.append("\"'");
+    FILE *pipe = exec_command_stream(cmd, "w");
+    if (pipe == NULL)
+        return;
+
+    uploadStream *stream = new uploadStream;
+    pthread_mutex_init(&stream->lock, NULL);
+    stream->pipe = pipe;
+    stream->next = 0;
+    stream->failed = false;
+    pthread_mutex_lock(&fileUploadLock);
+    fileUpload[fd] = stream;
+    pthread_mutex_unlock(&fileUploadLock);
+}
+
+/**
+   Return the upload stream for local descriptor fd, or NULL.
+ */
+uploadStream *upload_find(const int fd)
+{
+    uploadStream *stream = NULL;
+    pthread_mutex_lock(&fileUploadLock);
+    map<int,uploadStream*>::iterator it = fileUpload.find(fd);
+    if (it != fileUpload.end())
+        stream = it->second;
+    pthread_mutex_unlock(&fileUploadLock);
+    return stream;
+}
+
+/**
+   Close the device-side writer of a stream.  Must be called with
+   stream->lock held.
+
+   @return true if the writer exited successfully.
+ */
+bool upload_close(uploadStream *stream)
+{
+    if (stream->pipe == NULL)
+        return false;
+    int status = pclose(stream->pipe);
+    stream->pipe = NULL;
+    return status == 0;
+}
+
+/**
+   Forward data just written to the staged copy to the upload stream
+   of fd, if there is one.  A write that does not start where the
+   previous one ended, or a write after the stream was closed, stops
+   streaming for the rest of the handle's life.
+
+   @param path FUSE path, for tracing.
+   @param fd local descriptor of the staged copy.
+   @param buf data written.
+   @param size number of bytes written.
+   @param offset file offset of the write.
+ */
+void upload_write(const char *path, const int fd, const char *buf,
+		  const size_t size, const off_t offset)
+{
+    uploadStream *stream = upload_find(fd);
+    if (stream == NULL)
+        return;
+
+    ioSlot slot(IO_BULK);
+    pthread_mutex_lock(&stream->lock);
+    if (!stream->failed) {
+        if (stream->pipe == NULL || offset != stream->next
+            || fwrite(buf, 1, size, stream->pipe) != size) {
+            TRACE_INSTANT("xfer", "stream_fallback", path, offset);
+            VLOG(1) << "streaming stopped for " << path
+                    << " at offset " << offset << "\n";
+            upload_close(stream);
+            stream->failed = true;
+        } else {
+            TRACE_INSTANT("xfer", "stream_write", path, size);
+            stream->next += size;
+        }
+    }
+    pthread_mutex_unlock(&stream->lock);
+}
+
+/**
+   Finish the upload stream of fd, waiting for the device-side writer
+   to exit.
+
+   @param path FUSE path, for tracing.
+   @param fd local descriptor of the staged copy.
+   @return true if everything written so far reached the device and
+   the staged copy need not be pushed.
+ */
+bool upload_finish(const char *path, const int fd)
+{
+    uploadStream *stream = upload_find(fd);
+    if (stream == NULL)
+        return false;
+
+    traceScope trace("xfer", "stream_finish", path);
+    pthread_mutex_lock(&stream->lock);
+    bool complete = false;
+    if (!stream->failed) {
+        complete = upload_close(stream);
+        // The device-side writer may have failed without a trace in
+        // the exit status; only what arrived counts.
+        if (complete && remote_file_size(path) != stream->next) {
+            TRACE_INSTANT("xfer", "stream_incomplete", path, stream->next);
+            complete = false;
+        }
+        stream->failed = !complete;
+        trace.set_bytes(stream->next);
+    }
+    pthread_mutex_unlock(&stream->lock);
+    return complete;
+}
+
+/**
+   Drop the upload stream of fd, if any, closing its writer.
+ */
+void upload_release(const int fd)
+{
+    pthread_mutex_lock(&fileUploadLock);
+    map<int,uploadStream*>::iterator it = fileUpload.find(fd);
+    uploadStream *stream = NULL;
+    if (it != fileUpload.end()) {
+        stream = it->second;
+        fileUpload.erase(it);
+    }
+    pthread_mutex_unlock(&fileUploadLock);
+    if (stream == NULL)
+        return;
+
+    upload_close(stream);
+    pthread_mutex_destroy(&stream->lock);
+    delete stream;
+}
+
+/**
+   Return the path of the local copy of a device file under
+   /tmp/adbfs.  The path is flattened into one name by turning "/"
+   into "-", after escaping "%" and "-" so that distinct paths such
+   as /d/a-b and /d/a/b never share a local copy.
+
+   @param path device-side path.
+ */
+string local_path_for(const string path)
+{
+    string local_path_string = path;
+    string_replacer(local_path_string,"%","%25");
+    string_replacer(local_path_string,"-","%2d");
+    string_replacer(local_path_string,"/","-");
+    local_path_string.insert(0, "/tmp/adbfs/");
+    return local_path_string;
+}
+
+/**
+   Return the directory part of a device path ("/" for top-level
+   entries).
+ */
+string parent_path(const string path)
+{
+    size_t pos = path.rfind('/');
+    if (pos == 0 || pos == string::npos)
+        return "/";
+    return path.substr(0, pos);
+}
+
+/**
+   Return true if path is dir or lies below it.
+ */
+bool path_is_under(const string path, const string dir)
+{
+    if (dir == "/" || path == dir)
+        return true;
+    return path.size() > dir.size() && path[dir.size()] == '/'
+        && path.compare(0, dir.size(), dir) == 0;
+}
+
+/**
+   Return true if the attributes of node id come from a bulk import
+   that has not expired.  Must be called with nodeLock held.
+ */
+static bool node_trusted(const nodeId id)
+{
+    return id != NODE_NONE && (nodes[id].flags & NODE_BULK)
+        && nodes[id].timestamp + conf.bulk_ttl > time(NULL);
+}
+
+/**
+   Clear the given flags on node id and everything below it.  Must be
+   called with nodeLock held.
+ */
+static void node_clear(const nodeId id, const int flags)
+{
+    nodes[id].flags &= ~flags;
+    for (nodeId c = nodes[id].first_child; c != NODE_NONE; c = nodes[c].next_sibling)
+        node_clear(c, flags);
+}
+
+/**
+   Append the paths of node id and the nodes below it that have any of
+   the given flags set.  Must be called with nodeLock held.
+ */
+static void node_collect(const nodeId id, const int flags, vector<string> &paths)
+{
+    if (nodes[id].flags & flags)
+        paths.push_back(nodes.path(id));
+    for (nodeId c = nodes[id].first_child; c != NODE_NONE; c = nodes[c].next_sibling)
+        node_collect(c, flags, paths);
+}
+
+/**
+   Append copies of node id and the nodes below it, with their paths
+   relative to id, in an order where parents come first.  Must be
+   called with nodeLock held.
+ */
+static void node_snapshot(const nodeId id, const string rel,
+                          vector<pair<string,node> > &out)
+{
+    out.push_back(make_pair(rel, nodes[id]));
+    for (nodeId c = nodes[id].first_child; c != NODE_NONE; c = nodes[c].next_sibling)
+        node_snapshot(c, rel + "/" + nodes.name(c), out);
+}
+
+/**
+   Return true if any of the given node flags is set for path.
+ */
+bool cache_test(const string path, const int flags)
+{
+    pthread_mutex_lock(&nodeLock);
+    nodeId id = nodes.lookup(path);
+    bool set = id != NODE_NONE && (nodes[id].flags & flags);
+    pthread_mutex_unlock(&nodeLock);
+    return set;
+}
+
+/**
+   Set or clear node flags of path.  Setting a flag creates the node.
+ */
+void cache_mark(const string path, const int flags, const bool set)
+{
+    pthread_mutex_lock(&nodeLock);
+    nodeId id = set ? nodes.create(path) : nodes.lookup(path);
+    if (id != NODE_NONE) {
+        if (set)
+            nodes[id].flags |= flags;
+        else
+            nodes[id].flags &= ~flags;
+    }
+    pthread_mutex_unlock(&nodeLock);
+}
+
+/**
+   Return true if the local copy of path can be opened without
+   pulling it again.
+ */
+bool cache_has_content(const string path)
+{
+    pthread_mutex_lock(&nodeLock);
+    nodeId id = nodes.lookup(path);
+    bool has = id != NODE_NONE && ((nodes[id].flags & NODE_DIRTY)
+        || (node_trusted(id) && (nodes[id].flags & NODE_CONTENT)));
+    pthread_mutex_unlock(&nodeLock);
+    return has;
+}
+
+/**
+   Look up the attributes of path without asking the device.
+
+   @param path device-side path.
+   @param attr filled in on a hit.
+   @return 1 on a hit, -ENOENT if a trusted listing of the parent
+   directory shows that path does not exist, 0 if the device has to
+   be asked.
+ */
+int cache_get_attr(const string path, nodeAttr &attr)
 {
     int res = 0;
-    memset(stbuf, 0, sizeof(struct stat));
-    queue<string> output;
-    string path_string;
-    path_string.assign(path);
+    pthread_mutex_lock(&nodeLock);
+    nodeId id = nodes.lookup(path);
+    if (id != NODE_NONE) {
+        if (node_trusted(id) && (nodes[id].flags & NODE_ATTR)) {
+            attr = nodes[id].attr;
+            res = 1;
+        }
+    } else {
+        nodeId parent = nodes.lookup(parent_path(path));
+        if (parent != NODE_NONE && (nodes[parent].flags & NODE_LISTED)
+            && node_trusted(parent))
+            res = -ENOENT;
+    }
+    pthread_mutex_unlock(&nodeLock);
+    return res;
+}
 
-    // TODO caching?
-    if (true || fileData.find(path_string) ==  fileData.end() 
-	|| fileData[path_string].timestamp + 30 > time(NULL)){
-        string command = "stat -t \"";
-        command.append(path_string);
-        command.append("\"");
-        cout << command<<"\n";
-        output = adb_shell(command);
-        fileData[path_string].statOutput = output;
-        fileData[path_string].timestamp = time(NULL);
-    }else{
-        output = fileData[path_string].statOutput;
-        cout << "from cache " << output.front() <<"\n";
+/**
+   Record the attributes of path as just reported by the device, if
+   the table already has a node for it.  No node is created: only
+   attributes from a bulk import are ever served, so holding others
+   would just push imported entries out of the table.
+ */
+void cache_put_attr(const string path, const nodeAttr &attr)
+{
+    pthread_mutex_lock(&nodeLock);
+    nodeId id = nodes.lookup(path);
+    if (id != NODE_NONE) {
+        node &n = nodes[id];
+        n.attr = attr;
+        n.flags = (n.flags & ~NODE_BULK) | NODE_ATTR;
+        n.timestamp = time(NULL);
     }
+    pthread_mutex_unlock(&nodeLock);
+}
+
+/**
+   Drop what is known about a path the device reported missing,
+   unless it has local state that is still needed.
+ */
+void cache_forget(const string path)
+{
+    pthread_mutex_lock(&nodeLock);
+    nodeId id = nodes.lookup(path);
+    if (id != NODE_NONE && nodes[id].children == 0 && !(nodes[id].flags & NODE_KEEP))
+        nodes.remove(id);
+    pthread_mutex_unlock(&nodeLock);
+}
+
+/**
+   Forget what bulk_import recorded about path and everything below
+   it, after it was changed through the mount.
+
+   @param path device-side path.
+ */
+void cache_invalidate(const string path)
+{
+    pthread_mutex_lock(&nodeLock);
+    nodeId id = nodes.lookup(path);
+    if (id != NODE_NONE)
+        node_clear(id, NODE_BULK | NODE_CONTENT | NODE_LISTED);
+    pthread_mutex_unlock(&nodeLock);
+}
+
+/**
+   Keep the cached listing of the parent of path, if there is one, in
+   step with an entry created or removed through the mount.  A removed
+   entry loses all its cached state, including a deferred upload.
+
+   @param path device-side path.
+   @param present true if path now exists.
+ */
+void cache_update_listing(const string path, const bool present)
+{
+    pthread_mutex_lock(&nodeLock);
+    if (present) {
+        nodeId parent = nodes.lookup(parent_path(path));
+        if (parent != NODE_NONE && (nodes[parent].flags & NODE_LISTED))
+            nodes[nodes.create(path)].timestamp = time(NULL);
+    } else {
+        nodes.remove(nodes.lookup(path));
+    }
+    pthread_mutex_unlock(&nodeLock);
+}
+
+/**
+   Record a device-side copy of src at dst: everything known about
+   src and the paths below it is duplicated at dst, so the copy is
+   served from the cache as long as the original would have been.
+   The copy must be new, so whatever the table still held for dst is
+   stale and replaced.  Local copies and deferred uploads are not
+   carried over.
+
+   @param src device-side path that was copied.
+   @param dst device-side path of the copy, which did not exist
+   before.
+ */
+void cache_copy(const string src, const string dst)
+{
+    vector<pair<string,node> > copies;
+    pthread_mutex_lock(&nodeLock);
+    nodeId id = nodes.lookup(src);
+    if (id != NODE_NONE)
+        node_snapshot(id, "", copies);
+    if (!copies.empty())
+        nodes.remove(nodes.lookup(dst));
+    unsigned long long evictions = nodes.evictions();
+    for (size_t i = 0; i < copies.size(); ++i) {
+        const node &from = copies[i].second;
+        node &to = nodes[nodes.create(dst + copies[i].first)];
+        to.attr = from.attr;
+        to.attr.ino = 0;
+        to.flags |= from.flags & (NODE_ATTR | NODE_BULK | NODE_LISTED);
+        to.timestamp = from.timestamp;
+    }
+    // Listings that lost entries to eviction meanwhile are incomplete.
+    id = nodes.lookup(dst);
+    if (id != NODE_NONE && nodes.evictions() != evictions)
+        node_clear(id, NODE_LISTED);
+    pthread_mutex_unlock(&nodeLock);
+}
+
+/**
+   Return a summary of the node table for the control file.
+ */
+string cache_stats()
+{
+    char line[200];
+    pthread_mutex_lock(&nodeLock);
+    snprintf(line, sizeof line, "nodes %lu/%lu, %lu KiB, %llu evicted\n",
+             (unsigned long) nodes.size(), (unsigned long) nodes.max_size(),
+             (unsigned long) (nodes.memory() / 1024), nodes.evictions());
+    pthread_mutex_unlock(&nodeLock);
+    return line;
+}
+
+/**
+   Parse the output of busybox "stat -t".
+
+   @param output the command output.
+   @param attr filled in on success.
+   @return false if the output is not a stat line, i.e. the file does
+   not exist.
+ */
+bool parse_stat(const queue<string> &output, nodeAttr &attr)
+{
+    if (output.empty())
+        return false;
     vector<string> output_chunk = make_array(output.front());
     if (output_chunk.size() < 13){
-        return -ENOENT;
+        return false;
     }
     while (output_chunk.size() > 15){
         output_chunk.erase( output_chunk.begin());
@@ -299,26 +1103,446 @@ static int adb_getattr(const char *path, struct stat *stbuf)
        last change as seconds since the Unix Epoch (%Z)
        I/O block size (%o)
        */
-    //stbuf->st_dev = atoi(output_chunk[1].c_str());     /* ID of device containing file */
-    stbuf->st_ino = atoi(output_chunk[7].c_str());     /* inode number */
     unsigned int raw_mode;
     xtoi(output_chunk[3].c_str(),&raw_mode);
-    stbuf->st_mode = raw_mode | 0700;    /* protection */
-    stbuf->st_nlink = 1;   /* number of hard links */
-    stbuf->st_uid = atoi(output_chunk[4].c_str());     /* user ID of owner */
-    stbuf->st_gid = atoi(output_chunk[5].c_str());     /* group ID of owner */
-
     unsigned int device_id;
     xtoi(output_chunk[6].c_str(),&device_id);
-    stbuf->st_rdev = device_id;    // device ID (if special file)
 
-    stbuf->st_size = atoi(output_chunk[1].c_str());    /* total size, in bytes */
-    stbuf->st_blksize = atoi(output_chunk[14].c_str()); /* blocksize for filesystem I/O */
-    stbuf->st_blocks = atoi(output_chunk[2].c_str());  /* number of blocks allocated */
-    stbuf->st_atime = atol(output_chunk[11].c_str());   /* time of last access */
-    stbuf->st_mtime = atol(output_chunk[12].c_str());   /* time of last modification */
-    stbuf->st_ctime = atol(output_chunk[13].c_str());   /* time of last status change */
+    attr.size = atoll(output_chunk[1].c_str());
+    attr.blocks = atoll(output_chunk[2].c_str());
+    attr.mode = raw_mode;
+    attr.uid = atoi(output_chunk[4].c_str());
+    attr.gid = atoi(output_chunk[5].c_str());
+    attr.rdev = device_id;
+    attr.ino = atoll(output_chunk[7].c_str());
+    attr.atime = atol(output_chunk[11].c_str());
+    attr.mtime = atol(output_chunk[12].c_str());
+    attr.ctime = atol(output_chunk[13].c_str());
+    attr.blksize = atoi(output_chunk[14].c_str());
+    return true;
+}
+
+/**
+   Fill in a struct stat, as returned by getattr, from cached
+   attributes.
+ */
+void attr_to_stat(const nodeAttr &attr, struct stat *stbuf)
+{
+    stbuf->st_ino = attr.ino;
+    stbuf->st_mode = attr.mode | 0700;
+    stbuf->st_nlink = 1;
+    stbuf->st_uid = attr.uid;
+    stbuf->st_gid = attr.gid;
+    stbuf->st_rdev = attr.rdev;
+    stbuf->st_size = attr.size;
+    stbuf->st_blksize = attr.blksize;
+    stbuf->st_blocks = attr.blocks;
+    stbuf->st_atime = attr.atime;
+    stbuf->st_mtime = attr.mtime;
+    stbuf->st_ctime = attr.ctime;
+}
+
+/**
+   Return true if writes to path are deferred to bulk_export.
+ */
+bool under_bulk_root(const string path)
+{
+    bool under = false;
+    pthread_mutex_lock(&nodeLock);
+    for (set<string>::iterator it = bulkRoots.begin(); !under && it != bulkRoots.end(); ++it)
+        under = path_is_under(path, *it);
+    pthread_mutex_unlock(&nodeLock);
+    return under;
+}
+
+/**
+   Map a tar member name, relative to the directory the archive was
+   made in, back to a device path.
+ */
+string bulk_member_path(const string dir, string name)
+{
+    while (name.compare(0, 2, "./") == 0)
+        name.erase(0, 2);
+    while (!name.empty() && name[name.size() - 1] == '/')
+        name.erase(name.size() - 1);
+    if (name.empty() || name == ".")
+        return dir;
+    return (dir == "/" ? "" : dir) + "/" + name;
+}
+
+/** Marks the exit status of the device-side tar after the archive. */
+#define TAR_STATUS "adbfs-tar-status:"
+
+/**
+   Fetch a whole subtree from the device as one tar stream and unpack
+   it into the local content and attribute caches as it arrives.
+   Afterwards getattr, readdir and open below dir are served locally
+   until the entries are older than the bulk_ttl option, and writes
+   below dir are deferred to bulk_export.
+
+   @param dir device-side directory.
+   @return 0 on success, -ENOENT or -ENOTDIR if dir is not a
+   directory, -EIO if the transfer failed.
+ */
+int bulk_import(const string dir)
+{
+    traceScope trace("xfer", "tar_import", dir.c_str());
+    nodeAttr attr;
+    if (!parse_stat(adb_shell("stat -t \"" + dir + "\""), attr))
+        return -ENOENT;
+    if (!S_ISDIR(attr.mode))
+        return -ENOTDIR;
+
+    ioSlot slot(IO_BULK);
+    // adb exec-out does not pass on the exit status of tar, so the
+    // device shell appends it after the archive.
+    string cmd = "adb exec-out 'busybox tar -cf - -C \"";
+    cmd.append(dir);
+    cmd.append("\" . ; echo " TAR_STATUS "$?'");
+    FILE *in = exec_command_stream(cmd, "r");
+    if (in == NULL)
+        return -EIO;
+
+    vector<string> dirs;
+    pthread_mutex_lock(&nodeLock);
+    unsigned long long evictions = nodes.evictions();
+    pthread_mutex_unlock(&nodeLock);
+    time_t now = time(NULL);
+    long long bytes = 0;
+    long long chunk_end = conf.bulk_chunk;
+    tarEntry entry;
+    int res;
+    while ((res = tar_read_header(in, entry)) == 1) {
+        if (bytes >= chunk_end) {
+            slot.yield();
+            chunk_end = bytes + conf.bulk_chunk;
+        }
+        string path = bulk_member_path(dir, entry.name);
+        unsigned int type = 0;
+        if (entry.type == '0' || entry.type == '7')
+            type = S_IFREG;
+        else if (entry.type == '5')
+            type = S_IFDIR;
+        else if (entry.type == '2')
+            type = S_IFLNK;
+        // Local changes not exported yet win over the device's copy.
+        bool dirty = cache_test(path, NODE_DIRTY);
+
+        int fd = -1;
+        if (type == S_IFREG && !dirty)
+            fd = open(local_path_for(path).c_str(), O_WRONLY|O_CREAT|O_TRUNC, 0644);
+        bool complete = tar_read_data(in, entry.size, fd);
+        if (fd != -1 && close(fd) == -1)
+            complete = false;
+        if (!complete) {
+            res = -1;
+            break;
+        }
+        bytes += entry.size;
+
+        if (type == S_IFDIR)
+            dirs.push_back(path);
+        pthread_mutex_lock(&nodeLock);
+        node &n = nodes[nodes.create(path)];
+        if (!dirty) {
+            n.flags &= ~(NODE_ATTR | NODE_CONTENT);
+            n.flags |= NODE_BULK;
+            n.timestamp = now;
+        }
+        if (!dirty && type != 0) {
+            memset(&n.attr, 0, sizeof n.attr);
+            n.attr.mode = type | entry.mode;
+            n.attr.uid = entry.uid;
+            n.attr.gid = entry.gid;
+            n.attr.size = entry.size;
+            n.attr.blocks = (entry.size + 511) / 512;
+            n.attr.atime = n.attr.mtime = n.attr.ctime = entry.mtime;
+            n.attr.blksize = 4096;
+            n.flags |= NODE_ATTR;
+            if (type == S_IFREG)
+                n.flags |= NODE_CONTENT;
+        }
+        pthread_mutex_unlock(&nodeLock);
+    }
+    string trailer;
+    if (res == 0) {
+        char buf[TAR_BLOCK];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof buf, in)) > 0)
+            trailer.append(buf, n);
+    }
+    int status = pclose(in);
+    trace.set_bytes(bytes);
+    size_t mark = trailer.find(TAR_STATUS);
+    if (res != 0 || status != 0 || mark == string::npos
+        || atoi(trailer.c_str() + mark + strlen(TAR_STATUS)) != 0) {
+        VLOG(1) << "import of " << dir << " failed\n";
+        return -EIO;
+    }
+
+    // Listings are published only once complete, so readdir never
+    // sees half an import.  Entries older than the import are gone
+    // from the device.  If the table had to evict nodes meanwhile,
+    // some listings may have lost entries and none is published.
+    pthread_mutex_lock(&nodeLock);
+    bool complete = nodes.evictions() == evictions;
+    for (size_t i = 0; i < dirs.size(); ++i) {
+        nodeId id = nodes.lookup(dirs[i]);
+        if (id == NODE_NONE)
+            continue;
+        nodeId next;
+        for (nodeId c = nodes[id].first_child; c != NODE_NONE; c = next) {
+            next = nodes[c].next_sibling;
+            if (nodes[c].timestamp < now && !(nodes[c].flags & NODE_KEEP))
+                nodes.remove(c);
+        }
+        if (complete)
+            nodes[id].flags |= NODE_LISTED;
+    }
+    bulkRoots.insert(dir);
+    pthread_mutex_unlock(&nodeLock);
+    if (!complete) {
+        VLOG(1) << "import of " << dir << " exceeds max_nodes, listings not cached\n";
+    }
+    VLOG(1) << "imported " << dir << ": " << bytes << " bytes\n";
+    return 0;
+}
+
+/**
+   Upload every deferred file below dir in one tar stream, unpacked
+   on the device by busybox tar through adb exec-in.
 
+   @param dir device-side directory.
+   @return 0 on success, -EIO if the transfer failed; the files then
+   stay deferred.
+ */
+int bulk_export(const string dir)
+{
+    vector<string> paths;
+    pthread_mutex_lock(&nodeLock);
+    nodeId id = nodes.lookup(dir);
+    if (id != NODE_NONE)
+        node_collect(id, NODE_DIRTY, paths);
+    pthread_mutex_unlock(&nodeLock);
+    if (paths.empty())
+        return 0;
+
+    traceScope trace("xfer", "tar_export", dir.c_str());
+    ioSlot slot(IO_BULK);
+    FILE *out = exec_command_stream("adb exec-in 'busybox tar -x -o -f - -C /'", "w");
+    if (out == NULL)
+        return -EIO;
+
+    bool ok = true;
+    long long bytes = 0;
+    long long chunk_end = conf.bulk_chunk;
+    for (size_t i = 0; ok && i < paths.size(); ++i) {
+        if (bytes >= chunk_end) {
+            slot.yield();
+            chunk_end = bytes + conf.bulk_chunk;
+        }
+        int fd = open(local_path_for(paths[i]).c_str(), O_RDONLY);
+        struct stat st;
+        if (fd == -1 || fstat(fd, &st) == -1) {
+            // Removed locally since; nothing left to upload.
+            if (fd != -1)
+                close(fd);
+            continue;
+        }
+        tarEntry entry;
+        entry.name = paths[i].substr(1);
+        entry.type = '0';
+        entry.mode = st.st_mode & 07777;
+        entry.uid = 0;
+        entry.gid = 0;
+        entry.size = st.st_size;
+        entry.mtime = st.st_mtime;
+        ok = tar_write_entry(out, entry) && tar_write_data(out, fd, entry.size);
+        close(fd);
+        bytes += entry.size;
+    }
+    ok = tar_write_end(out) && ok;
+    if (pclose(out) != 0)
+        ok = false;
+    trace.set_bytes(bytes);
+    if (!ok)
+        return -EIO;
+
+    for (size_t i = 0; i < paths.size(); ++i) {
+        cache_mark(paths[i], NODE_DIRTY, false);
+        cache_invalidate(paths[i]);
+    }
+    adb_shell("sync");
+    VLOG(1) << "exported " << paths.size() << " files below " << dir << "\n";
+    return 0;
+}
+
+/** Marks the exit status of the device-side cp after its output. */
+#define CP_STATUS "adbfs-cp-status:"
+
+/**
+   Copy a file or directory within the device with busybox cp, so
+   the data never crosses the adb link, and create the cache entries
+   of the copy from those of the original.  As with cp, copying onto
+   an existing directory puts the copy inside it.  The copy itself
+   must not exist yet: cp would merge into or overwrite it, or nest
+   a directory one level deeper.  The copy succeeded only if cp
+   exited with status 0 and stat shows the copy with the type, and
+   for a file the size, of the original.
+
+   @param src device-side file or directory.
+   @param dst device-side destination path.
+   @return 0 on success, -EEXIST if the copy already exists, or
+   another negative errno value.
+ */
+int device_copy(const string src, string dst)
+{
+    traceScope trace("xfer", "device_copy", src.c_str());
+    // The device must have the current contents of both sides.
+    int res = bulk_export(src);
+    if (res == 0)
+        res = bulk_export(dst);
+    if (res < 0)
+        return res;
+
+    nodeAttr from, attr;
+    if (!parse_stat(adb_shell("stat -t \"" + src + "\""), from))
+        return -ENOENT;
+    if (parse_stat(adb_shell("stat -t \"" + dst + "\""), attr) && S_ISDIR(attr.mode))
+        dst = (dst == "/" ? "" : dst) + src.substr(src.rfind('/'));
+    if (path_is_under(dst, src))
+        return -EINVAL;
+    if (parse_stat(adb_shell("stat -t \"" + dst + "\""), attr))
+        return -EEXIST;
+
+    // As with tar in bulk_import, the device shell appends the exit
+    // status of cp, which adb does not pass on.  A recursive copy that
+    // stops partway, e.g. on a full device, is only seen this way.
+    string command = "adb exec-out 'busybox cp -Rp \"";
+    command.append(src);
+    command.append("\" \"");
+    command.append(dst);
+    command.append("\" 2>&1; echo " CP_STATUS "$?'");
+    string output;
+    {
+        // Runs as long as the copy takes, so it counts as a transfer.
+        ioSlot slot(IO_BULK);
+        FILE *in = exec_command_stream(command, "r");
+        if (in != NULL) {
+            char buf[256];
+            size_t n;
+            while ((n = fread(buf, 1, sizeof buf, in)) > 0)
+                output.append(buf, n);
+            pclose(in);
+        }
+        adb_shell("sync");
+    }
+
+    size_t mark = output.find(CP_STATUS);
+    if (mark == string::npos || atoi(output.c_str() + mark + strlen(CP_STATUS)) != 0
+        || !parse_stat(adb_shell("stat -t \"" + dst + "\""), attr)
+        || (attr.mode & S_IFMT) != (from.mode & S_IFMT)
+        || (S_ISREG(from.mode) && attr.size != from.size)) {
+        // A partial copy may be left behind.
+        cache_mark(parent_path(dst), NODE_LISTED, false);
+        VLOG(1) << "copy " << src << " to " << dst << " failed: "
+                << output.substr(0, mark) << "\n";
+        return -EIO;
+    }
+
+    // Without cache entries for src, only the parent listing changes.
+    cache_copy(src, dst);
+    if (!cache_test(dst, NODE_LIVE))
+        cache_update_listing(dst, true);
+    VLOG(1) << "copied " << src << " to " << dst << " on the device\n";
+    return 0;
+}
+
+/**
+   Run one command written to the control file.
+
+   @param line the command, without the trailing newline.
+   @return 0 on success or a negative errno value.
+   @see CONTROL_PATH.
+ */
+int control_command(const string line)
+{
+    size_t space = line.find(' ');
+    string verb = line.substr(0, space);
+    string arg;
+    if (space != string::npos)
+        arg = line.substr(space + 1);
+    while (arg.size() > 1 && arg[arg.size() - 1] == '/')
+        arg.erase(arg.size() - 1);
+
+    int res;
+    if (verb == "import" && !arg.empty() && arg[0] == '/')
+        res = bulk_import(arg);
+    else if (verb == "export" && (arg.empty() || arg[0] == '/'))
+        res = bulk_export(arg.empty() ? "/" : arg);
+    else if (verb == "copy" && !arg.empty() && arg[0] == '/'
+             && arg.find(" /", 1) != string::npos) {
+        // The destination starts at the first " /".
+        size_t split = arg.find(" /", 1);
+        res = device_copy(arg.substr(0, split), arg.substr(split + 1));
+    } else
+        res = -EINVAL;
+
+    pthread_mutex_lock(&controlLock);
+    controlStatus = line + ": " + (res == 0 ? "ok" : strerror(-res)) + "\n";
+    pthread_mutex_unlock(&controlLock);
+    return res;
+}
+
+/**
+   adbFS implementation of FUSE interface function fuse_operations.getattr.
+   @todo check shell escaping.
+ */
+static int adb_getattr(const char *path, struct stat *stbuf)
+{
+    traceScope trace("fuse", "getattr", path);
+    int res = 0;
+    memset(stbuf, 0, sizeof(struct stat));
+    queue<string> output;
+    string path_string;
+    path_string.assign(path);
+
+    if (path_string == CONTROL_PATH) {
+        stbuf->st_mode = S_IFREG | 0600;
+        stbuf->st_nlink = 1;
+        return 0;
+    }
+    if (cache_test(path_string, NODE_DIRTY)) {
+        // Deferred upload: the local copy is the current version.
+        TRACE_INSTANT("cache", "attr_dirty", path, -1);
+        if (stat(local_path_for(path_string).c_str(), stbuf) == -1)
+            return -errno;
+        stbuf->st_mode |= 0700;
+        return res;
+    }
+
+    nodeAttr attr;
+    int cached = cache_get_attr(path_string, attr);
+    if (cached < 0) {
+        TRACE_INSTANT("cache", "attr_negative", path, -1);
+        return cached;
+    }
+    if (cached == 0){
+        string command = "stat -t \"";
+        command.append(path_string);
+        command.append("\"");
+        TRACE_INSTANT("cache", "attr_miss", path, -1);
+        output = adb_shell(command);
+        if (!parse_stat(output, attr)) {
+            cache_forget(path_string);
+            return -ENOENT;
+        }
+        cache_put_attr(path_string, attr);
+    }else{
+        TRACE_INSTANT("cache", "attr_hit", path, -1);
+        VLOG(3) << "from cache " << path_string << "\n";
+    }
+    attr_to_stat(attr, stbuf);
     return res;
 }
 
@@ -330,15 +1554,30 @@ static int adb_getattr(const char *path, struct stat *stbuf)
 static int adb_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     off_t offset, struct fuse_file_info *fi)
 {
+    traceScope trace("fuse", "readdir", path);
     (void) offset;
     (void) fi;
     string path_string;
     string local_path_string;
     path_string.assign(path);
-    local_path_string.assign("/tmp/adbfs/");
-    string_replacer(path_string,"/","-");
-    local_path_string.append(path_string);
-    path_string.assign(path);
+    local_path_string = local_path_for(path_string);
+
+    vector<string> names;
+    pthread_mutex_lock(&nodeLock);
+    nodeId id = nodes.lookup(path_string);
+    bool listed = id != NODE_NONE && (nodes[id].flags & NODE_LISTED) && node_trusted(id);
+    if (listed)
+        for (nodeId c = nodes[id].first_child; c != NODE_NONE; c = nodes[c].next_sibling)
+            names.push_back(nodes.name(c));
+    pthread_mutex_unlock(&nodeLock);
+    if (listed) {
+        TRACE_INSTANT("cache", "listing_hit", path, names.size());
+        filler(buf, ".", NULL, 0);
+        filler(buf, "..", NULL, 0);
+        for (size_t i = 0; i < names.size(); ++i)
+            filler(buf, names[i].c_str(), NULL, 0);
+        return 0;
+    }
 
     queue<string> output;
     string command = "ls -1a --color=none \"";
@@ -349,11 +1588,25 @@ static int adb_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     if (output_chunk.size() >6){
         return -ENOENT;
     }
+    set<string> seen;
     while (output.size() > 0){
         filler(buf, output.front().c_str(), NULL, 0);
+        seen.insert(output.front());
         output.pop();
     }
 
+    // Files created below a bulk root exist only locally until the
+    // next export, so the device does not list them yet.
+    names.clear();
+    pthread_mutex_lock(&nodeLock);
+    id = nodes.lookup(path_string);
+    if (id != NODE_NONE)
+        for (nodeId c = nodes[id].first_child; c != NODE_NONE; c = nodes[c].next_sibling)
+            if ((nodes[c].flags & NODE_DIRTY) && !seen.count(nodes.name(c)))
+                names.push_back(nodes.name(c));
+    pthread_mutex_unlock(&nodeLock);
+    for (size_t i = 0; i < names.size(); ++i)
+        filler(buf, names[i].c_str(), NULL, 0);
 
     return 0;
 }
@@ -361,37 +1614,54 @@ static int adb_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
 
 static int adb_open(const char *path, struct fuse_file_info *fi)
 {
+    traceScope trace("fuse", "open", path);
     string path_string;
     string local_path_string;
     path_string.assign(path);
-    local_path_string.assign("/tmp/adbfs/");
-    string_replacer(path_string,"/","-");
-    local_path_string.append(path_string);
-    path_string.assign(path);
-    cout << "-- " << path_string << " " << local_path_string << "\n";
-    if (!fileTruncated[path_string]){
+    local_path_string = local_path_for(path_string);
+    VLOG(1) << "-- " << path_string << " " << local_path_string << "\n";
+    if (path_string == CONTROL_PATH) {
+        fi->direct_io = 1;
+        fi->fh = -1;
+        return 0;
+    }
+    // Set if the file is meant to be empty on the device, so that
+    // replacing it with what is written through this handle is safe.
+    bool empty = false;
+    if (cache_test(path_string, NODE_TRUNCATED)){
+        TRACE_INSTANT("cache", "content_truncated", path, -1);
+        cache_mark(path_string, NODE_TRUNCATED, false);
+        empty = local_file_size(local_path_string) == 0;
+    }else if (cache_has_content(path_string)){
+        TRACE_INSTANT("cache", "content_hit", path, -1);
+    }else{
         queue<string> output;
         string command = "stat -t \"";
         command.append(path_string);
         command.append("\"");
-        cout << command<<"\n";
         output = adb_shell(command);
-        vector<string> output_chunk = make_array(output.front());
-        if (output_chunk.size() < 13){
+        nodeAttr attr;
+        if (!parse_stat(output, attr)){
             return -ENOENT;
         }
-	path_string.assign(path);
-	local_path_string.assign("/tmp/adbfs/");
-	string_replacer(path_string,"/","-");
-	local_path_string.append(path_string);
-	shell_escape_path(local_path_string);
-	path_string.assign(path);
-        adb_pull(path_string,local_path_string);
-    }else{
-        fileTruncated[path_string] = false;
+        if (!adb_fetch(path_string,local_path_string,attr.size)){
+            // Do not leave a partial copy that looks like an empty file.
+            unlink(local_path_string.c_str());
+            return -EIO;
+        }
+        empty = attr.size == 0;
     }
 
     fi->fh = open(local_path_string.c_str(), fi->flags);
+    if ((int) fi->fh == -1)
+        return -errno;
+
+    // A write-only or read-write open of a file that is empty on the
+    // device (a new or truncated file) can be uploaded while it is
+    // being written.  Below a bulk root writes are deferred instead.
+    if (conf.stream_writes && (fi->flags & O_ACCMODE) != O_RDONLY
+        && empty && !under_bulk_root(path_string))
+        upload_start(fi->fh, path_string);
 
     return 0;
 }
@@ -399,6 +1669,19 @@ static int adb_open(const char *path, struct fuse_file_info *fi)
 static int adb_read(const char *path, char *buf, size_t size, off_t offset,
     struct fuse_file_info *fi)
 {
+    traceScope trace("fuse", "read", path);
+    if (strcmp(path, CONTROL_PATH) == 0) {
+        pthread_mutex_lock(&controlLock);
+        string status = controlStatus;
+        pthread_mutex_unlock(&controlLock);
+        status.append(io_stats());
+        status.append(cache_stats());
+        if (offset >= (off_t) status.size())
+            return 0;
+        size_t n = min(size, status.size() - offset);
+        memcpy(buf, status.data() + offset, n);
+        return n;
+    }
     int fd;
     int res;
     fd = fi->fh; //open(local_path_string.c_str(), O_RDWR);
@@ -408,11 +1691,67 @@ static int adb_read(const char *path, char *buf, size_t size, off_t offset,
     //close(fd);
     if(res == -1)
         res = -errno;
+    else
+        trace.set_bytes(res);
 
-    return size;
+    return res;
+}
+
+/**
+   adbFS implementation of FUSE interface function
+   fuse_operations.read_buf.  Hands FUSE the cached file descriptor
+   instead of the data, so that it can splice the file into the
+   kernel pipe without copying it through this process.
+ */
+static int adb_read_buf(const char *path, struct fuse_bufvec **bufp,
+    size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *src = (struct fuse_bufvec*) malloc(sizeof(struct fuse_bufvec));
+    if (src == NULL)
+        return -ENOMEM;
+    *src = FUSE_BUFVEC_INIT(size);
+
+    if (strcmp(path, CONTROL_PATH) == 0) {
+        // FUSE frees mem together with the vector.
+        char *mem = (char*) malloc(size);
+        int res = mem == NULL ? -ENOMEM : adb_read(path, mem, size, offset, fi);
+        if (res < 0) {
+            free(mem);
+            free(src);
+            return res;
+        }
+        src->buf[0].mem = mem;
+        src->buf[0].size = res;
+        *bufp = src;
+        return 0;
+    }
+
+    TRACE_INSTANT("fuse", "read_buf", path, size);
+    src->buf[0].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    src->buf[0].fd = fi->fh;
+    src->buf[0].pos = offset;
+    *bufp = src;
+    return 0;
 }
 
 static int adb_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+    traceScope trace("fuse", "write", path);
+    if (strcmp(path, CONTROL_PATH) == 0) {
+        string lines(buf, size);
+        size_t start = 0;
+        while (start < lines.size()) {
+            size_t end = lines.find('\n', start);
+            if (end == string::npos)
+                end = lines.size();
+            if (end > start) {
+                int res = control_command(lines.substr(start, end - start));
+                if (res < 0)
+                    return res;
+            }
+            start = end + 1;
+        }
+        return size;
+    }
     string path_string;
     string local_path_string;
     path_string.assign(path);
@@ -430,32 +1769,84 @@ static int adb_write(const char *path, const char *buf, size_t size, off_t offse
     //adb_shell("sync");
     if (res == -1)
         res = -errno;
+    else {
+        trace.set_bytes(res);
+        upload_write(path, fd, buf, res, offset);
+    }
     return res;
 }
 
 
+/**
+   adbFS implementation of FUSE interface function
+   fuse_operations.write_buf.  Data FUSE received through a pipe is
+   spliced straight into the staged copy.  Control commands and
+   streamed uploads need the bytes in memory and go through
+   adb_write.
+ */
+static int adb_write_buf(const char *path, struct fuse_bufvec *buf,
+    off_t offset, struct fuse_file_info *fi)
+{
+    size_t size = fuse_buf_size(buf);
+    if (strcmp(path, CONTROL_PATH) == 0 || upload_find(fi->fh) != NULL) {
+        vector<char> data(size);
+        struct fuse_bufvec mem = FUSE_BUFVEC_INIT(size);
+        mem.buf[0].mem = size > 0 ? &data[0] : NULL;
+        ssize_t res = fuse_buf_copy(&mem, buf, (enum fuse_buf_copy_flags) 0);
+        if (res <= 0)
+            return res;
+        return adb_write(path, &data[0], res, offset, fi);
+    }
+
+    traceScope trace("fuse", "write_buf", path);
+    int fd = fi->fh;
+    filePendingWrite[fd] = true;
+
+    struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+    dst.buf[0].flags = (enum fuse_buf_flags) (FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+    dst.buf[0].fd = fd;
+    dst.buf[0].pos = offset;
+    ssize_t res = fuse_buf_copy(&dst, buf, FUSE_BUF_SPLICE_NONBLOCK);
+    if (res >= 0)
+        trace.set_bytes(res);
+    return res;
+}
+
 static int adb_flush(const char *path, struct fuse_file_info *fi) {
+    traceScope trace("fuse", "flush", path);
     string path_string;
     string local_path_string;
     path_string.assign(path);
-    local_path_string.assign("/tmp/adbfs/");
-    string_replacer(path_string,"/","-");
-    local_path_string.append(path_string);
-    path_string.assign(path);
+    local_path_string = local_path_for(path_string);
     int flags = fi->flags;
     int fd = fi->fh;
-    cout << "flag is: "<< flags <<"\n";
+    VLOG(3) << "flag is: "<< flags <<"\n";
+    if (path_string == CONTROL_PATH)
+        return 0;
     if (filePendingWrite[fd]) {
         filePendingWrite[fd] = false;
-        adb_push(local_path_string,path_string);
-        adb_shell("sync");
+        if (upload_finish(path, fd)) {
+            adb_shell("sync");
+            cache_invalidate(path_string);
+        } else if (under_bulk_root(path_string)) {
+            TRACE_INSTANT("xfer", "deferred", path, -1);
+            cache_mark(path_string, NODE_DIRTY, true);
+        } else {
+            adb_send(local_path_string,path_string);
+            adb_shell("sync");
+            cache_invalidate(path_string);
+        }
     }
     return 0;
 }
 
 static int adb_release(const char *path, struct fuse_file_info *fi) {
+    traceScope trace("fuse", "release", path);
+    if (strcmp(path, CONTROL_PATH) == 0)
+        return 0;
     int fd = fi->fh;
-    filePendingWrite.erase(filePendingWrite.find(fd));
+    filePendingWrite.erase(fd);
+    upload_release(fd);
     close(fd);
     return 0;
 }
@@ -466,81 +1857,84 @@ static int adb_access(const char *path, int mask) {
 }
 
 static int adb_utimens(const char *path, const struct timespec ts[2]) {
+    traceScope trace("fuse", "utimens", path);
     string path_string;
     string local_path_string;
     path_string.assign(path);
-    fileData[path_string].timestamp = fileData[path_string].timestamp + 50;
-    local_path_string.assign("/tmp/adbfs/");
-    string_replacer(path_string,"/","-");
-    local_path_string.append(path_string);
-    path_string.assign(path);
+    if (path_string == CONTROL_PATH)
+        return 0;
+    cache_invalidate(path_string);
+    local_path_string = local_path_for(path_string);
 
     queue<string> output;
     string command = "touch \"";
     command.append(path_string);
     command.append("\"");
-    cout << command<<"\n";
     adb_shell(command);
 
     return 0;
 }
 
 static int adb_truncate(const char *path, off_t size) {
+    traceScope trace("fuse", "truncate", path);
     string path_string;
     string local_path_string;
     path_string.assign(path);
-    fileData[path_string].timestamp = fileData[path_string].timestamp + 50;
-    local_path_string.assign("/tmp/adbfs/");
-    string_replacer(path_string,"/","-");
-    local_path_string.append(path_string);
-    path_string.assign(path);
+    if (path_string == CONTROL_PATH)
+        return 0;
+    bool dirty = cache_test(path_string, NODE_DIRTY);
+    cache_invalidate(path_string);
+    local_path_string = local_path_for(path_string);
 
-    queue<string> output;
-    string command = "stat -t \"";
-    command.append(path_string);
-    command.append("\"");
-    cout << command<<"\n";
-    output = adb_shell(command);
-    vector<string> output_chunk = make_array(output.front());
-    if (output_chunk.size() < 13){
-        adb_pull(path_string,local_path_string);
+    if (!dirty) {
+        queue<string> output;
+        string command = "stat -t \"";
+        command.append(path_string);
+        command.append("\"");
+        output = adb_shell(command);
+        vector<string> output_chunk = make_array(output.front());
+        if (output_chunk.size() < 13){
+            adb_pull(path_string,local_path_string);
+        }
     }
 
-    fileTruncated[path_string] = true;
+    cache_mark(path_string, NODE_TRUNCATED, true);
 
-    cout << "truncate[path=" << local_path_string << "][size=" << size << "]" << endl;
+    VLOG(1) << "truncate[path=" << local_path_string << "][size=" << size << "]\n";
 
     return truncate(local_path_string.c_str(),size);
 }
 
 static int adb_mknod(const char *path, mode_t mode, dev_t rdev) {
+    traceScope trace("fuse", "mknod", path);
     string path_string;
     string local_path_string;
     path_string.assign(path);
-    local_path_string.assign("/tmp/adbfs/");
-    string_replacer(path_string,"/","-");
-    local_path_string.append(path_string);
-    path_string.assign(path);
+    local_path_string = local_path_for(path_string);
 
-    cout << "mknod for " << local_path_string << "\n";
+    VLOG(1) << "mknod for " << local_path_string << "\n";
     mknod(local_path_string.c_str(),mode, rdev);
+    cache_invalidate(path_string);
+    cache_update_listing(path_string, true);
+    if (S_ISREG(mode) && under_bulk_root(path_string)) {
+        // Created on the device by the next bulk_export.
+        cache_mark(path_string, NODE_DIRTY, true);
+        return 0;
+    }
     adb_push(local_path_string,path_string);
     adb_shell("sync");
 
-    fileData[path_string].timestamp = fileData[path_string].timestamp + 50;
-
     return 0;
 }
 
 static int adb_mkdir(const char *path, mode_t mode) {
+    traceScope trace("fuse", "mkdir", path);
     string path_string;
     string local_path_string;
     path_string.assign(path);
-    fileData[path_string].timestamp = fileData[path_string].timestamp + 50;
-    local_path_string.assign("/tmp/adbfs/");
-    string_replacer(path_string,"/","-");
-    local_path_string.append(path_string);
-    path_string.assign(path);
+    cache_invalidate(path_string);
+    cache_update_listing(path_string, true);
+    local_path_string = local_path_for(path_string);
     string command;
     command.assign("mkdir '");
     command.append(path_string);
@@ -550,29 +1944,39 @@ static int adb_mkdir(const char *path, mode_t mode) {
 }
 
 static int adb_rename(const char *from, const char *to) {
+    traceScope trace("fuse", "rename", from);
     string local_from_string,local_to_string ="/tmp/adbfs/";
 
     local_from_string.append(from);
     local_to_string.append(to);
+    // The device must have the current contents before they move.
+    int res = bulk_export(from);
+    if (res < 0)
+        return res;
+    // The move replaces to, so a deferred write to it must not be
+    // exported over the moved file, nor its local copy served.
+    cache_mark(to, NODE_KEEP, false);
+    unlink(local_path_for(to).c_str());
+    cache_invalidate(to);
+    cache_update_listing(from, false);
+    cache_update_listing(to, true);
     string command = "mv '";
     command.append(from);
     command.append("' '");
     command.append(to);
     command.append("'");
-    cout << "Renaming " << from << " to " << to <<"\n";
+    VLOG(1) << "Renaming " << from << " to " << to <<"\n";
     adb_shell(command);
     return 0;
 }
 
 static int adb_rmdir(const char *path) {
+    traceScope trace("fuse", "rmdir", path);
     string path_string;
     string local_path_string;
     path_string.assign(path);
-    fileData[path_string].timestamp = fileData[path_string].timestamp + 50;
-    local_path_string.assign("/tmp/adbfs/");
-    string_replacer(path_string,"/","-");
-    local_path_string.append(path_string);
-    path_string.assign(path);
+    cache_update_listing(path_string, false);
+    local_path_string = local_path_for(path_string);
 
     string command = "rmdir '";
     command.append(path_string);
@@ -584,14 +1988,12 @@ static int adb_rmdir(const char *path) {
 }
 
 static int adb_unlink(const char *path) {
+    traceScope trace("fuse", "unlink", path);
     string path_string;
     string local_path_string;
     path_string.assign(path);
-    fileData[path_string].timestamp = fileData[path_string].timestamp + 50;
-    local_path_string.assign("/tmp/adbfs/");
-    string_replacer(path_string,"/","-");
-    local_path_string.append(path_string);
-    path_string.assign(path);
+    cache_update_listing(path_string, false);
+    local_path_string = local_path_for(path_string);
 
     string command = "rm '";
     command.append(path_string);
@@ -604,6 +2006,7 @@ static int adb_unlink(const char *path) {
 
 static int adb_readlink(const char *path, char *buf, size_t size)
 {
+    traceScope trace("fuse", "readlink", path);
     string path_string(path);
     string_replacer(path_string,"'","\\'");
     queue<string> output;
@@ -628,6 +2031,32 @@ static int adb_readlink(const char *path, char *buf, size_t size)
     return 0;
 }
 
+/**
+   adbFS implementation of FUSE interface function fuse_operations.init.
+   Runs in the process that serves the mount, after FUSE has
+   daemonized, so this is where background threads are started.
+   Also asks the kernel to move file data through pipes, which
+   read_buf and write_buf make use of; -o no_splice_read and
+   -o no_splice_write turn that off again.
+ */
+static void *adb_init(struct fuse_conn_info *conn)
+{
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE);
+    trace_start_control();
+    return NULL;
+}
+
+/**
+   adbFS implementation of FUSE interface function fuse_operations.destroy.
+   Uploads whatever bulk writes are still deferred before unmounting.
+ */
+static void adb_destroy(void *private_data)
+{
+    (void) private_data;
+    if (bulk_export("/") < 0)
+        cerr << "adbfs: deferred files left in /tmp/adbfs could not be uploaded\n";
+}
+
 /**
    Main struct for FUSE interface.
  */
@@ -637,10 +2066,60 @@ static struct fuse_operations adbfs_oper;
    Set up the fuse_operations struct adbfs_oper using above adb_*
    functions and then call fuse_main to manage things.
 
+   Besides the usual FUSE options, the following -o options are
+   understood:
+   - verbose=N: log level, see log_verbosity.
+   - trace: start with event tracing enabled.
+   - trace_file=PATH: where SIGUSR2 writes the trace
+     (default /tmp/adbfs-trace.json).
+   - stream_writes: upload new and truncated files while they are
+     being written sequentially; needs adb exec-in (Android 5.0+).
+   - bulk_ttl=SECONDS: how long attributes and contents brought in by
+     an "import" control command are trusted (default 600).
+   - interactive_slots=N, bulk_slots=N: how many metadata commands
+     and content transfers may run at once (default 4, and stripes
+     for bulk).
+   - bulk_chunk=BYTES: transfers give way to waiting metadata
+     commands after every chunk of this size (default 4 MiB).
+   - max_nodes=N: how many paths the attribute and listing cache
+     holds before it evicts the least recently used (default 262144).
+   - stripes=N: fetch files larger than stripe_size=BYTES (default
+     64 MiB) as that many parallel ranged reads (default 1, off).
+   - stripe_verify: also compare the MD5 sums of striped fetches.
+
    @see fuse_main in fuse.h.
+   @see trace.h.
  */
 int main(int argc, char *argv[])
 {
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    conf.bulk_ttl = 600;
+    conf.interactive_slots = 4;
+    conf.stripes = 1;
+    conf.stripe_size = 64 << 20;
+    conf.bulk_chunk = 4 << 20;
+    conf.max_nodes = 1 << 18;
+    if (fuse_opt_parse(&args, &conf, adbfs_opts, NULL) == -1)
+        return 1;
+    log_verbosity = conf.verbose;
+    io_set_limit(IO_INTERACTIVE, conf.interactive_slots);
+    if (conf.stripes < 1)
+        conf.stripes = 1;
+    if (conf.stripe_size < (1 << 20))
+        conf.stripe_size = 1 << 20;
+    conf.stripe_size -= conf.stripe_size % STRIPE_BLOCK;
+    // Stripes run in parallel only as far as bulk slots allow.
+    if (conf.bulk_slots == 0)
+        conf.bulk_slots = conf.stripes;
+    io_set_limit(IO_BULK, conf.bulk_slots);
+    if (conf.bulk_chunk < 65536)
+        conf.bulk_chunk = 65536;
+    nodes.set_limit(conf.max_nodes);
+    trace_enabled = conf.trace;
+    if (conf.trace_file != NULL)
+        trace_file.assign(conf.trace_file);
+    trace_block_signals();
+
     clearTmpDir();
     memset(&adbfs_oper, sizeof(adbfs_oper), 0);
     adbfs_oper.readdir= adb_readdir;
@@ -651,6 +2130,8 @@ int main(int argc, char *argv[])
     adbfs_oper.release = adb_release;
     adbfs_oper.read= adb_read;
     adbfs_oper.write = adb_write;
+    adbfs_oper.read_buf = adb_read_buf;
+    adbfs_oper.write_buf = adb_write_buf;
     adbfs_oper.utimens = adb_utimens;
     adbfs_oper.truncate = adb_truncate;
     adbfs_oper.mknod = adb_mknod;
@@ -659,5 +2140,9 @@ int main(int argc, char *argv[])
     adbfs_oper.rmdir = adb_rmdir;
     adbfs_oper.unlink = adb_unlink;
     adbfs_oper.readlink = adb_readlink;
-    return fuse_main(argc, argv, &adbfs_oper, NULL);
+    adbfs_oper.init = adb_init;
+    adbfs_oper.destroy = adb_destroy;
+    int res = fuse_main(args.argc, args.argv, &adbfs_oper, NULL);
+    fuse_opt_free_args(&args);
+    return res;
 }
@@ -0,0 +1,159 @@
+/*
+ *      Software License Agreement (BSD License)
+ *
+ *      Copyright (c) 2010-2011, Calvin Tee (collectskin.com)
+ *      All rights reserved.
+ *
+ *      Redistribution and use in source and binary forms, with or without
+ *      modification, are permitted provided that the following conditions are
+ *      met:
+ *
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following disclaimer
+ *        in the documentation and/or other materials provided with the
+ *        distribution.
+ *      * Neither the name of the  nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ *      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+   @file
+
+   Memory and lookup benchmark for nodeTable against the
+   map<string,fileCache> it replaced.
+
+   Builds a synthetic tree of 1000 directories with 1000 files each
+   (1M paths, Android-like names), fills in attributes, then looks
+   up every path three times in a scattered order.  Heap usage is
+   taken from mallinfo2, so this needs glibc 2.33 or later.  A second
+   run with a limit of 100000 nodes shows that eviction keeps the
+   table bounded.
+
+   Usage: bench/nodetable [dirs] [files_per_dir]
+ */
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <map>
+#include <queue>
+#include <set>
+#include <string>
+#include <vector>
+#include "../nodetable.h"
+
+using namespace std;
+
+/** Per-path record of the string-keyed cache nodeTable replaced. */
+struct fileCache {
+    time_t timestamp;
+    queue<string> statOutput;
+    bool bulk;
+    bool content;
+    bool listed;
+    set<string> entries;
+};
+
+static size_t heap_used()
+{
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, size_t entries, size_t bytes,
+                   double insert, double lookup, size_t hits, size_t lookups)
+{
+    printf("%-24s %8lu entries %8.1f MiB  insert %6.0f ns  lookup %6.0f ns  hits %lu/%lu\n",
+           name, (unsigned long) entries, bytes / 1048576.0,
+           insert * 1e9 / entries, lookup * 1e9 / lookups,
+           (unsigned long) hits, (unsigned long) lookups);
+}
+
+int main(int argc, char *argv[])
+{
+    int dirs = argc > 1 ? atoi(argv[1]) : 1000;
+    int files = argc > 2 ? atoi(argv[2]) : 1000;
+
+    vector<string> paths;
+    paths.reserve((size_t) dirs * files);
+    char buf[256];
+    for (int d = 0; d < dirs; ++d)
+        for (int f = 0; f < files; ++f) {
+            snprintf(buf, sizeof buf,
+                     "/sdcard/Android/data/com.example.app%04d/files/asset_%05d.png", d, f);
+            paths.push_back(buf);
+        }
+    // A typical busybox "stat -t" line, as fileCache kept it.
+    string line = paths[0] + " 12345 24 81b0 10123 1028 fd00 123456 1 0 0"
+        " 1700000000 1700000000 1700000000 4096";
+    size_t lookups = 3 * paths.size();
+
+    {
+        size_t base = heap_used();
+        nodeTable table;
+        table.set_limit(paths.size() * 2);
+        double t0 = now();
+        for (size_t i = 0; i < paths.size(); ++i) {
+            node &n = table[table.create(paths[i])];
+            n.attr.size = 12345;
+            n.flags |= NODE_ATTR;
+            n.timestamp = 1;
+        }
+        double t1 = now();
+        size_t hits = 0;
+        for (size_t i = 0; i < lookups; ++i)
+            hits += table.lookup(paths[(i * 7919) % paths.size()]) != NODE_NONE;
+        double t2 = now();
+        report("nodeTable", table.size(), heap_used() - base, t1 - t0, t2 - t1, hits, lookups);
+    }
+    {
+        size_t base = heap_used();
+        map<string,fileCache> cache;
+        double t0 = now();
+        for (size_t i = 0; i < paths.size(); ++i) {
+            fileCache &c = cache[paths[i]];
+            c.statOutput.push(line);
+            c.timestamp = 1;
+        }
+        double t1 = now();
+        size_t hits = 0;
+        for (size_t i = 0; i < lookups; ++i)
+            hits += cache.count(paths[(i * 7919) % paths.size()]);
+        double t2 = now();
+        report("map<string,fileCache>", cache.size(), heap_used() - base,
+               t1 - t0, t2 - t1, hits, lookups);
+    }
+    {
+        nodeTable table;
+        table.set_limit(100000);
+        for (size_t i = 0; i < paths.size(); ++i)
+            table.create(paths[i]);
+        printf("nodeTable, max 100000: %lu nodes, %.1f MiB, %llu evicted\n",
+               (unsigned long) table.size(), table.memory() / 1048576.0,
+               table.evictions());
+    }
+    return 0;
+}
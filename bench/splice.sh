@@ -0,0 +1,60 @@
+#!/bin/sh
+# Splice benchmark.  Mounts adbfs against bench/adb, imports /sdcard
+# so that reads are served from the local copies and writes are
+# deferred, and times reading and writing one large file through the
+# mount with splicing on and with -o no_splice_read,no_splice_write.
+# The import and the export at unmount are not timed.
+#
+# Usage: bench/splice.sh [SIZE_MIB]
+# Default: 1024 MiB file.
+
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+size=${1:-1024}
+
+work=$(mktemp -d)
+trap 'fusermount -u "$work/mnt" 2>/dev/null; rm -rf "$work"' EXIT
+mkdir -p "$work/device/sdcard" "$work/mnt"
+head -c $((size << 20)) /dev/urandom > "$work/device/sdcard/big.bin"
+
+# Only the local copies are measured, so the link is not capped.
+ADBFS_BENCH_DEVICE=$work/device
+ADBFS_BENCH_RATE=100000000000
+PATH=$here:$PATH
+export ADBFS_BENCH_DEVICE ADBFS_BENCH_RATE PATH
+
+report() {
+    echo "$1 $2 $3 $size" | awk \
+        '{ t = $3 - $2; printf "%-22s %6.2f s, %7.1f MB/s\n", $1, t, $4 * 1048576 / t / 1e6 }'
+}
+
+echo "$size MiB file"
+for mode in splice no_splice; do
+    opts=big_writes
+    if [ $mode = no_splice ]; then
+        opts=$opts,no_splice_read,no_splice_write
+    fi
+    # In the foreground, so that the export at unmount can be waited
+    # for before the next mount clears /tmp/adbfs.
+    "$here/../adbfs" -f -o $opts "$work/mnt" &
+    pid=$!
+    while [ ! -e "$work/mnt/.adbfs_control" ]; do
+        sleep 0.1
+    done
+    echo "import /sdcard" > "$work/mnt/.adbfs_control"
+
+    start=$(date +%s.%N)
+    dd if="$work/mnt/sdcard/big.bin" of=/dev/null bs=1M 2>/dev/null
+    end=$(date +%s.%N)
+    report "$mode read" $start $end
+
+    start=$(date +%s.%N)
+    dd if=/dev/zero of="$work/mnt/sdcard/new.bin" bs=1M count=$size 2>/dev/null
+    end=$(date +%s.%N)
+    report "$mode write" $start $end
+
+    fusermount -u "$work/mnt"
+    wait $pid
+    cmp -n $((size << 20)) /dev/zero "$work/device/sdcard/new.bin"
+    rm -f "$work/device/sdcard/new.bin"
+done
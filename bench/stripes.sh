@@ -0,0 +1,34 @@
+#!/bin/sh
+# Striped fetch benchmark.  Mounts adbfs against bench/adb, whose
+# streams are capped at RATE bytes per second each, and times reading
+# one large file through the mount for several stripe counts.
+#
+# Usage: bench/stripes.sh [SIZE_MIB [RATE [STRIPE_MIB]]]
+# Defaults: 256 MiB file, 10000000 bytes/s per stream, 16 MiB stripes.
+
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+size=${1:-256}
+rate=${2:-10000000}
+stripe=${3:-16}
+
+work=$(mktemp -d)
+trap 'fusermount -u "$work/mnt" 2>/dev/null; rm -rf "$work"' EXIT
+mkdir -p "$work/device/sdcard" "$work/mnt"
+head -c $((size << 20)) /dev/urandom > "$work/device/sdcard/big.bin"
+
+ADBFS_BENCH_DEVICE=$work/device
+ADBFS_BENCH_RATE=$rate
+PATH=$here:$PATH
+export ADBFS_BENCH_DEVICE ADBFS_BENCH_RATE PATH
+
+echo "$size MiB file, $rate bytes/s per stream, $stripe MiB stripes"
+for stripes in 1 2 4 8; do
+    "$here/../adbfs" -o stripes=$stripes,stripe_size=$((stripe << 20)) "$work/mnt"
+    start=$(date +%s.%N)
+    cmp "$work/mnt/sdcard/big.bin" "$work/device/sdcard/big.bin"
+    end=$(date +%s.%N)
+    fusermount -u "$work/mnt"
+    echo "$stripes $start $end $size" | awk \
+        '{ t = $3 - $2; printf "stripes %d: %6.2f s, %6.1f MB/s\n", $1, t, $4 * 1048576 / t / 1e6 }'
+done
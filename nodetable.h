@@ -0,0 +1,401 @@
+/*
+ *      Software License Agreement (BSD License)
+ *
+ *      Copyright (c) 2010-2011, Calvin Tee (collectskin.com)
+ *      All rights reserved.
+ *
+ *      Redistribution and use in source and binary forms, with or without
+ *      modification, are permitted provided that the following conditions are
+ *      met:
+ *
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following disclaimer
+ *        in the documentation and/or other materials provided with the
+ *        distribution.
+ *      * Neither the name of the  nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ *      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+   @file
+
+   Table of the device paths adbFS knows about.
+
+   Each path component is a node holding its name once, a link to its
+   parent and a fixed-size attribute record.  Nodes are found through
+   a hash of (parent id, name), so no full path string is ever stored
+   or compared.  Node ids are indexes into one array and stay valid
+   until the node is removed or evicted.
+
+   The table holds at most a configured number of nodes.  Beyond that,
+   a clock sweep evicts leaf nodes that carry no state which cannot be
+   fetched from the device again (see NODE_KEEP).
+ */
+
+#ifndef ADBFS_NODETABLE_H
+#define ADBFS_NODETABLE_H
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+
+typedef uint32_t nodeId;
+
+#define NODE_NONE 0
+#define NODE_ROOT 1
+
+/** Node flags. */
+enum {
+    NODE_LIVE       = 1 << 0,   // slot in use
+    NODE_ATTR       = 1 << 1,   // attr holds the result of the last stat
+    NODE_BULK       = 1 << 2,   // attr filled by a bulk import, trusted until it expires
+    NODE_CONTENT    = 1 << 3,   // the local copy in /tmp/adbfs is current
+    NODE_LISTED     = 1 << 4,   // the children are the complete directory listing
+    NODE_TRUNCATED  = 1 << 5,   // truncated locally; open must not pull
+    NODE_DIRTY      = 1 << 6,   // local copy not uploaded yet
+    NODE_REFERENCED = 1 << 7    // used since the clock hand last passed
+};
+
+/** Flags that keep a node from being evicted. */
+#define NODE_KEEP (NODE_TRUNCATED | NODE_DIRTY)
+
+/**
+   Attributes of a device file, as reported by stat.
+ */
+struct nodeAttr {
+    int64_t size;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+    uint64_t ino;
+    uint64_t blocks;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t rdev;
+    uint32_t blksize;
+};
+
+struct node {
+    nodeId parent;
+    nodeId first_child;
+    nodeId next_sibling;
+    nodeId prev_sibling;
+    nodeId hash_next;
+    uint32_t name_off;
+    uint16_t name_len;
+    uint16_t flags;
+    uint32_t children;
+    int64_t timestamp;      // when attr was filled in
+    nodeAttr attr;
+};
+
+class nodeTable {
+public:
+    nodeTable() : live(0), garbage(0), limit(1 << 18), hand(NODE_ROOT), evicted(0)
+    {
+        nodes.resize(2);
+        memset(&nodes[0], 0, 2 * sizeof(node));
+        nodes[NODE_ROOT].flags = NODE_LIVE;
+        buckets.assign(1024, NODE_NONE);
+        live = 1;
+    }
+
+    /**
+       Set the number of nodes above which eviction starts.
+     */
+    void set_limit(const size_t max_nodes)
+    {
+        limit = max_nodes > 16 ? max_nodes : 16;
+    }
+
+    node &operator[](const nodeId id) { return nodes[id]; }
+
+    /**
+       Return the node of a path, or NODE_NONE if it is not known.
+     */
+    nodeId lookup(const std::string &path)
+    {
+        nodeId id = NODE_ROOT;
+        size_t pos = 0;
+        const char *name;
+        size_t len;
+        while (id != NODE_NONE && next_component(path, pos, name, len))
+            id = child(id, name, len);
+        if (id != NODE_NONE)
+            nodes[id].flags |= NODE_REFERENCED;
+        return id;
+    }
+
+    /**
+       Return the node of a path, creating it and any missing
+       ancestors.  May evict other nodes, but never the one returned
+       or its ancestors; ids obtained before the call must be looked
+       up again.
+     */
+    nodeId create(const std::string &path)
+    {
+        nodeId id = NODE_ROOT;
+        size_t pos = 0;
+        const char *name;
+        size_t len;
+        bool created = false;
+        while (next_component(path, pos, name, len)) {
+            nodeId next = child(id, name, len);
+            if (next == NODE_NONE) {
+                next = add_child(id, name, len);
+                created = true;
+            }
+            id = next;
+        }
+        nodes[id].flags |= NODE_REFERENCED;
+        if (created && live > limit)
+            evict(id);
+        return id;
+    }
+
+    /**
+       Return the child of parent with the given name, or NODE_NONE.
+     */
+    nodeId child(const nodeId parent, const char *name, const size_t len) const
+    {
+        nodeId id = buckets[hash(parent, name, len) & (buckets.size() - 1)];
+        for (; id != NODE_NONE; id = nodes[id].hash_next) {
+            const node &n = nodes[id];
+            if (n.parent == parent && n.name_len == len
+                && memcmp(&names[n.name_off], name, len) == 0)
+                return id;
+        }
+        return NODE_NONE;
+    }
+
+    /**
+       Remove a node and everything below it.
+     */
+    void remove(const nodeId id)
+    {
+        if (id == NODE_ROOT || id == NODE_NONE)
+            return;
+        while (nodes[id].first_child != NODE_NONE)
+            remove(nodes[id].first_child);
+        release(id);
+    }
+
+    /** Return the name of a node (empty for the root). */
+    std::string name(const nodeId id) const
+    {
+        return std::string(names.empty() ? "" : &names[nodes[id].name_off],
+                           nodes[id].name_len);
+    }
+
+    /** Return the full path of a node. */
+    std::string path(nodeId id) const
+    {
+        if (id == NODE_ROOT)
+            return "/";
+        std::string result;
+        for (; id != NODE_ROOT; id = nodes[id].parent)
+            result.insert(0, "/" + name(id));
+        return result;
+    }
+
+    /** Number of nodes in use. */
+    size_t size() const { return live; }
+
+    /** Number of nodes evicted so far. */
+    unsigned long long evictions() const { return evicted; }
+
+    /** Node count above which eviction starts. */
+    size_t max_size() const { return limit; }
+
+    /** Bytes allocated for the table. */
+    size_t memory() const
+    {
+        return nodes.capacity() * sizeof(node) + free_ids.capacity() * sizeof(nodeId)
+            + buckets.capacity() * sizeof(nodeId) + names.capacity();
+    }
+
+private:
+    std::vector<node> nodes;
+    std::vector<nodeId> free_ids;
+    std::vector<nodeId> buckets;
+    std::vector<char> names;
+    size_t live;
+    size_t garbage;         // bytes of names of removed nodes
+    size_t limit;
+    nodeId hand;            // clock hand for eviction
+    unsigned long long evicted;
+
+    static bool next_component(const std::string &path, size_t &pos,
+                               const char *&name, size_t &len)
+    {
+        while (pos < path.size() && path[pos] == '/')
+            ++pos;
+        if (pos >= path.size())
+            return false;
+        size_t end = path.find('/', pos);
+        if (end == std::string::npos)
+            end = path.size();
+        name = path.data() + pos;
+        len = end - pos;
+        pos = end;
+        return true;
+    }
+
+    static uint32_t hash(const nodeId parent, const char *name, const size_t len)
+    {
+        uint32_t h = 2166136261u ^ (parent * 2654435761u);
+        for (size_t i = 0; i < len; ++i)
+            h = (h ^ (unsigned char) name[i]) * 16777619u;
+        return h;
+    }
+
+    nodeId add_child(const nodeId parent, const char *name, const size_t len)
+    {
+        nodeId id;
+        if (!free_ids.empty()) {
+            id = free_ids.back();
+            free_ids.pop_back();
+        } else {
+            id = nodes.size();
+            nodes.resize(nodes.size() + 1);
+        }
+        node &n = nodes[id];
+        memset(&n, 0, sizeof n);
+        n.parent = parent;
+        n.flags = NODE_LIVE;
+        n.name_off = names.size();
+        n.name_len = len;
+        names.insert(names.end(), name, name + len);
+
+        node &p = nodes[parent];
+        n.next_sibling = p.first_child;
+        if (p.first_child != NODE_NONE)
+            nodes[p.first_child].prev_sibling = id;
+        p.first_child = id;
+        ++p.children;
+
+        if (++live > buckets.size())
+            rehash(buckets.size() * 2);
+        else
+            link_hash(id);
+        return id;
+    }
+
+    void link_hash(const nodeId id)
+    {
+        node &n = nodes[id];
+        nodeId &head = buckets[hash(n.parent, &names[n.name_off], n.name_len)
+                               & (buckets.size() - 1)];
+        n.hash_next = head;
+        head = id;
+    }
+
+    void unlink_hash(const nodeId id)
+    {
+        node &n = nodes[id];
+        nodeId *link = &buckets[hash(n.parent, &names[n.name_off], n.name_len)
+                                & (buckets.size() - 1)];
+        while (*link != id)
+            link = &nodes[*link].hash_next;
+        *link = n.hash_next;
+    }
+
+    void rehash(const size_t count)
+    {
+        buckets.assign(count, NODE_NONE);
+        for (nodeId id = NODE_ROOT + 1; id < nodes.size(); ++id)
+            if (nodes[id].flags & NODE_LIVE)
+                link_hash(id);
+    }
+
+    /**
+       Free a childless node.
+     */
+    void release(const nodeId id)
+    {
+        node &n = nodes[id];
+        unlink_hash(id);
+        node &p = nodes[n.parent];
+        if (n.prev_sibling != NODE_NONE)
+            nodes[n.prev_sibling].next_sibling = n.next_sibling;
+        else
+            p.first_child = n.next_sibling;
+        if (n.next_sibling != NODE_NONE)
+            nodes[n.next_sibling].prev_sibling = n.prev_sibling;
+        --p.children;
+        n.flags = 0;
+        garbage += n.name_len;
+        free_ids.push_back(id);
+        --live;
+        if (garbage > 65536 && garbage > names.size() / 2)
+            compact_names();
+    }
+
+    void compact_names()
+    {
+        std::vector<char> packed;
+        packed.reserve(names.size() - garbage);
+        for (nodeId id = NODE_ROOT + 1; id < nodes.size(); ++id) {
+            node &n = nodes[id];
+            if (!(n.flags & NODE_LIVE))
+                continue;
+            uint32_t off = packed.size();
+            packed.insert(packed.end(), names.begin() + n.name_off,
+                          names.begin() + n.name_off + n.name_len);
+            n.name_off = off;
+        }
+        names.swap(packed);
+        garbage = 0;
+    }
+
+    /**
+       Advance the clock hand, evicting unreferenced leaves until the
+       table is back to 7/8 of its limit or two full sweeps found
+       nothing more to evict.  A listing that loses an entry this way
+       is no longer complete.  If only nodes that must be kept remain,
+       the table grows past its limit instead.
+
+       @param keep node that must survive; its ancestors have children
+       while it lives, so they are never leaves.
+     */
+    void evict(const nodeId keep)
+    {
+        size_t target = limit - limit / 8;
+        size_t steps = 2 * nodes.size();
+        while (live > target && steps-- > 0) {
+            if (++hand >= nodes.size())
+                hand = NODE_ROOT + 1;
+            node &n = nodes[hand];
+            if (!(n.flags & NODE_LIVE) || n.children > 0 || (n.flags & NODE_KEEP)
+                || hand == keep)
+                continue;
+            if (n.flags & NODE_REFERENCED) {
+                n.flags &= ~NODE_REFERENCED;
+                continue;
+            }
+            nodes[n.parent].flags &= ~NODE_LISTED;
+            release(hand);
+            ++evicted;
+        }
+    }
+};
+
+#endif
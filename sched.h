@@ -0,0 +1,231 @@
+/*
+ *      Software License Agreement (BSD License)
+ *
+ *      Copyright (c) 2010-2011, Calvin Tee (collectskin.com)
+ *      All rights reserved.
+ *
+ *      Redistribution and use in source and binary forms, with or without
+ *      modification, are permitted provided that the following conditions are
+ *      met:
+ *
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following disclaimer
+ *        in the documentation and/or other materials provided with the
+ *        distribution.
+ *      * Neither the name of the  nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ *      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+   @file
+
+   Device I/O scheduler.
+
+   Every piece of work that talks to the device takes a slot of its
+   priority class first.  Each class has its own concurrency limit,
+   and a class is only admitted while no higher-priority work is
+   running or waiting, so a metadata lookup never queues behind a
+   large transfer for longer than one chunk of it: bulk transfers
+   pause between chunks with ioSlot::yield.  So that a steady stream
+   of metadata work cannot starve transfers completely, a class that
+   has been held back for IO_MAX_DEFER_US only waits for its own
+   limit.
+ */
+
+#ifndef ADBFS_SCHED_H
+#define ADBFS_SCHED_H
+
+#include <pthread.h>
+#include <stdio.h>
+#include <string>
+#include "trace.h"
+
+/**
+   Priority classes, highest first.
+ */
+enum ioClass {
+    IO_INTERACTIVE,     // getattr, readdir, readlink and other small commands
+    IO_BULK,            // file contents: pull, push, tar streams
+    IO_CLASSES
+};
+
+static const char *io_class_names[IO_CLASSES] = { "interactive", "bulk" };
+
+struct ioClassState {
+    int limit;
+    int active;
+    int waiting;
+    int max_waiting;
+    unsigned long long served;
+    long long wait_total;   // microseconds
+    long long wait_max;     // microseconds
+};
+
+static ioClassState io_state[IO_CLASSES] = {
+    { 4, 0, 0, 0, 0, 0, 0 },
+    { 1, 0, 0, 0, 0, 0, 0 },
+};
+
+/** Longest a class is held back for higher-priority work. */
+#define IO_MAX_DEFER_US 200000
+
+static pthread_mutex_t io_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t io_cond = PTHREAD_COND_INITIALIZER;
+
+/** Slots held by the calling thread; nested requests reuse them. */
+static __thread int io_held = 0;
+
+/**
+   Set the number of concurrent slots of a class.  Call before the
+   filesystem starts serving requests.
+ */
+void io_set_limit(const ioClass c, const int limit)
+{
+    pthread_mutex_lock(&io_lock);
+    io_state[c].limit = limit > 0 ? limit : 1;
+    pthread_mutex_unlock(&io_lock);
+}
+
+/**
+   Return true if higher-priority classes than c have work running or
+   waiting.  Must be called with io_lock held.
+ */
+static bool io_higher_busy(const ioClass c)
+{
+    for (int higher = 0; higher < c; ++higher)
+        if (io_state[higher].active > 0 || io_state[higher].waiting > 0)
+            return true;
+    return false;
+}
+
+/**
+   Return true if a slot of class c may be handed out now.  Must be
+   called with io_lock held.
+
+   @param starved true once the caller has waited IO_MAX_DEFER_US.
+ */
+static bool io_admissible(const ioClass c, const bool starved)
+{
+    if (io_state[c].active >= io_state[c].limit)
+        return false;
+    return starved || !io_higher_busy(c);
+}
+
+/**
+   Wait for and take a slot of class c.  A thread that already holds
+   a slot keeps using it, so nested device work cannot deadlock.
+ */
+void io_acquire(const ioClass c)
+{
+    if (io_held++ > 0)
+        return;
+
+    ioClassState &state = io_state[c];
+    pthread_mutex_lock(&io_lock);
+    if (!io_admissible(c, false)) {
+        traceScope trace("sched", io_class_names[c], NULL);
+        long long start = trace_now();
+        ++state.waiting;
+        if (state.waiting > state.max_waiting)
+            state.max_waiting = state.waiting;
+        long long waited = 0;
+        while (!io_admissible(c, waited >= IO_MAX_DEFER_US)) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += 10 * 1000000;
+            if (deadline.tv_nsec >= 1000000000) {
+                deadline.tv_sec += 1;
+                deadline.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&io_cond, &io_lock, &deadline);
+            waited = trace_now() - start;
+        }
+        --state.waiting;
+        state.wait_total += waited;
+        if (waited > state.wait_max)
+            state.wait_max = waited;
+    }
+    ++state.active;
+    ++state.served;
+    pthread_mutex_unlock(&io_lock);
+}
+
+/**
+   Give back a slot taken with io_acquire.
+ */
+void io_release(const ioClass c)
+{
+    if (--io_held > 0)
+        return;
+
+    pthread_mutex_lock(&io_lock);
+    --io_state[c].active;
+    pthread_cond_broadcast(&io_cond);
+    pthread_mutex_unlock(&io_lock);
+}
+
+/**
+   Scoped slot of one class.
+ */
+class ioSlot {
+public:
+    ioSlot(const ioClass c) : c(c) { io_acquire(c); }
+    ~ioSlot() { io_release(c); }
+
+    /**
+       Pause until higher-priority work has finished, or for at most
+       IO_MAX_DEFER_US.  Bulk transfers call this between chunks.
+     */
+    void yield()
+    {
+        if (io_held > 1)
+            return;
+        pthread_mutex_lock(&io_lock);
+        bool contended = io_higher_busy(c);
+        pthread_mutex_unlock(&io_lock);
+        if (contended) {
+            io_release(c);
+            io_acquire(c);
+        }
+    }
+private:
+    ioClass c;
+};
+
+/**
+   Return a table of per-class queue depth and wait time metrics.
+ */
+std::string io_stats()
+{
+    std::string out = "class        active limit waiting max_waiting"
+        "     served  wait_avg_ms  wait_max_ms\n";
+    pthread_mutex_lock(&io_lock);
+    for (int c = 0; c < IO_CLASSES; ++c) {
+        const ioClassState &s = io_state[c];
+        char line[200];
+        snprintf(line, sizeof line, "%-12s %6d %5d %7d %11d %10llu %12.1f %12.1f\n",
+                 io_class_names[c], s.active, s.limit, s.waiting, s.max_waiting,
+                 s.served, s.served ? s.wait_total / 1000.0 / s.served : 0.0,
+                 s.wait_max / 1000.0);
+        out.append(line);
+    }
+    pthread_mutex_unlock(&io_lock);
+    return out;
+}
+
+#endif
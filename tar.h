@@ -0,0 +1,347 @@
+/*
+ *      Software License Agreement (BSD License)
+ *
+ *      Copyright (c) 2010-2011, Calvin Tee (collectskin.com)
+ *      All rights reserved.
+ *
+ *      Redistribution and use in source and binary forms, with or without
+ *      modification, are permitted provided that the following conditions are
+ *      met:
+ *
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following disclaimer
+ *        in the documentation and/or other materials provided with the
+ *        distribution.
+ *      * Neither the name of the  nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ *      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+   @file
+
+   Minimal streaming reader and writer for the tar archives produced
+   and accepted by busybox tar: ustar headers plus the GNU long name
+   ('L'/'K') and pax ('x') extensions for long paths.  Data is never
+   held in memory beyond one block, so archives are unpacked while
+   they arrive.
+ */
+
+#ifndef ADBFS_TAR_H
+#define ADBFS_TAR_H
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+
+#define TAR_BLOCK 512
+
+/**
+   One archive member, with long names already resolved.
+ */
+struct tarEntry {
+    std::string name;
+    std::string linkname;
+    char type;          // '0' file, '2' symlink, '5' directory, ...
+    unsigned int mode;  // permission bits only
+    unsigned int uid;
+    unsigned int gid;
+    long long size;
+    long long mtime;
+};
+
+/**
+   Parse a numeric header field: octal text, or GNU base-256 when the
+   top bit of the first byte is set.
+ */
+static long long tar_parse_number(const char *field, size_t len)
+{
+    if ((unsigned char) field[0] & 0x80) {
+        long long value = field[0] & 0x7f;
+        for (size_t i = 1; i < len; ++i)
+            value = (value << 8) | (unsigned char) field[i];
+        return value;
+    }
+    long long value = 0;
+    size_t i = 0;
+    while (i < len && (field[i] == ' ' || field[i] == '\0'))
+        ++i;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; ++i)
+        value = value * 8 + (field[i] - '0');
+    return value;
+}
+
+static std::string tar_field_string(const char *field, size_t len)
+{
+    return std::string(field, strnlen(field, len));
+}
+
+/**
+   Read exactly size bytes, discarding them if buf is NULL, plus the
+   padding up to the next block boundary.
+
+   @return true on success, false on a short read.
+ */
+static bool tar_read_padded(FILE *in, char *buf, long long size)
+{
+    char block[TAR_BLOCK];
+    long long left = (size + TAR_BLOCK - 1) / TAR_BLOCK * TAR_BLOCK;
+    while (left > 0) {
+        if (fread(block, 1, TAR_BLOCK, in) != TAR_BLOCK)
+            return false;
+        if (buf != NULL && size > 0) {
+            size_t n = size < TAR_BLOCK ? size : TAR_BLOCK;
+            memcpy(buf, block, n);
+            buf += n;
+            size -= n;
+        }
+        left -= TAR_BLOCK;
+    }
+    return true;
+}
+
+/**
+   Apply the records of a pax extended header to entry.  Only path,
+   linkpath and size are of interest here.
+ */
+static void tar_apply_pax(const std::string &records, tarEntry &entry)
+{
+    size_t pos = 0;
+    while (pos < records.size()) {
+        size_t space = records.find(' ', pos);
+        if (space == std::string::npos)
+            break;
+        size_t len = atol(records.c_str() + pos);
+        if (len == 0 || pos + len > records.size())
+            break;
+        std::string record = records.substr(space + 1, pos + len - space - 2);
+        size_t eq = record.find('=');
+        if (eq != std::string::npos) {
+            std::string key = record.substr(0, eq);
+            std::string value = record.substr(eq + 1);
+            if (key == "path")
+                entry.name = value;
+            else if (key == "linkpath")
+                entry.linkname = value;
+            else if (key == "size")
+                entry.size = atoll(value.c_str());
+        }
+        pos += len;
+    }
+}
+
+/**
+   Read the next member header from a tar stream.  Long name and pax
+   headers are consumed and folded into the returned entry.  The
+   caller must then consume entry.size bytes of data with
+   tar_read_data.
+
+   @param in the archive stream.
+   @param entry filled in with the member.
+   @return 1 for a member, 0 at the end-of-archive block, -1 on a
+   malformed or truncated stream, including one that stops without
+   an end-of-archive block.
+ */
+int tar_read_header(FILE *in, tarEntry &entry)
+{
+    std::string long_name, long_link, pax;
+    bool have_pax = false;
+    char block[TAR_BLOCK];
+    for (;;) {
+        if (fread(block, 1, TAR_BLOCK, in) != TAR_BLOCK)
+            return -1;
+        if (block[0] == '\0')
+            return 0;
+
+        unsigned int sum = 0;
+        for (int i = 0; i < TAR_BLOCK; ++i)
+            sum += (i >= 148 && i < 156) ? ' ' : (unsigned char) block[i];
+        if (sum != tar_parse_number(block + 148, 8))
+            return -1;
+
+        char type = block[156];
+        long long size = tar_parse_number(block + 124, 12);
+        if (type == 'L' || type == 'K' || type == 'x') {
+            std::string data(size, '\0');
+            if (!tar_read_padded(in, &data[0], size))
+                return -1;
+            if (type == 'L')
+                long_name = tar_field_string(data.c_str(), data.size());
+            else if (type == 'K')
+                long_link = tar_field_string(data.c_str(), data.size());
+            else {
+                pax = data;
+                have_pax = true;
+            }
+            continue;
+        }
+        if (type == 'g') {
+            if (!tar_read_padded(in, NULL, size))
+                return -1;
+            continue;
+        }
+
+        entry.name = tar_field_string(block, 100);
+        if (memcmp(block + 257, "ustar", 6) == 0 && block[345] != '\0')
+            entry.name = tar_field_string(block + 345, 155) + "/" + entry.name;
+        entry.linkname = tar_field_string(block + 157, 100);
+        entry.type = type == '\0' ? '0' : type;
+        entry.mode = tar_parse_number(block + 100, 8) & 07777;
+        entry.uid = tar_parse_number(block + 108, 8);
+        entry.gid = tar_parse_number(block + 116, 8);
+        entry.size = size;
+        entry.mtime = tar_parse_number(block + 136, 12);
+        if (!long_name.empty())
+            entry.name = long_name;
+        if (!long_link.empty())
+            entry.linkname = long_link;
+        if (have_pax)
+            tar_apply_pax(pax, entry);
+        return 1;
+    }
+}
+
+/**
+   Copy the data of the current member to a file descriptor, or skip
+   it if out_fd is -1.
+
+   @return true on success, false on a short read or write error.
+ */
+bool tar_read_data(FILE *in, long long size, int out_fd)
+{
+    char block[TAR_BLOCK];
+    while (size > 0) {
+        if (fread(block, 1, TAR_BLOCK, in) != TAR_BLOCK)
+            return false;
+        size_t n = size < TAR_BLOCK ? size : TAR_BLOCK;
+        if (out_fd != -1 && write(out_fd, block, n) != (ssize_t) n)
+            return false;
+        size -= n;
+    }
+    return true;
+}
+
+/**
+   Format a numeric header field as octal text, or in GNU base-256 if
+   the value needs more than len - 1 octal digits, as sizes of 8 GiB
+   and more do in the 12-byte size field.
+ */
+static void tar_format_number(char *field, size_t len, long long value)
+{
+    if (value < 0)
+        value = 0;
+    if (value < 1LL << (3 * (len - 1))) {
+        snprintf(field, len, "%0*llo", (int) len - 1, value);
+        return;
+    }
+    for (size_t i = len - 1; i > 0; --i) {
+        field[i] = (char) (value & 0xff);
+        value >>= 8;
+    }
+    field[0] = (char) 0x80;
+}
+
+static bool tar_write_header(FILE *out, const std::string &name, char type,
+                             const tarEntry &entry, long long size)
+{
+    char block[TAR_BLOCK];
+    memset(block, 0, TAR_BLOCK);
+    strncpy(block, name.c_str(), 100);
+    tar_format_number(block + 100, 8, entry.mode);
+    tar_format_number(block + 108, 8, entry.uid);
+    tar_format_number(block + 116, 8, entry.gid);
+    tar_format_number(block + 124, 12, size);
+    tar_format_number(block + 136, 12, entry.mtime);
+    block[156] = type;
+    strncpy(block + 157, entry.linkname.c_str(), 100);
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+    memset(block + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < TAR_BLOCK; ++i)
+        sum += (unsigned char) block[i];
+    snprintf(block + 148, 8, "%06o", sum);
+    return fwrite(block, 1, TAR_BLOCK, out) == TAR_BLOCK;
+}
+
+/**
+   Write the header of a member, preceded by a GNU long name header
+   if the name does not fit.  For regular files the caller then
+   writes entry.size bytes with tar_write_data.
+
+   @return true on success.
+ */
+bool tar_write_entry(FILE *out, const tarEntry &entry)
+{
+    if (entry.name.size() >= 100) {
+        tarEntry longname = entry;
+        longname.linkname.clear();
+        if (!tar_write_header(out, "././@LongLink", 'L', longname,
+                              entry.name.size() + 1))
+            return false;
+        std::string data = entry.name;
+        data.resize((entry.name.size() + TAR_BLOCK) / TAR_BLOCK * TAR_BLOCK, '\0');
+        if (fwrite(data.data(), 1, data.size(), out) != data.size())
+            return false;
+    }
+    return tar_write_header(out, entry.name.substr(0, 99), entry.type, entry,
+                            entry.type == '0' ? entry.size : 0);
+}
+
+/**
+   Copy size bytes from a file descriptor into the archive as the
+   data of the current member, padding to a block boundary.  If the
+   file turns out shorter, the rest is zero-filled so that the
+   archive stays well-formed.
+
+   @return true if all size bytes were read from in_fd.
+ */
+bool tar_write_data(FILE *out, int in_fd, long long size)
+{
+    char block[TAR_BLOCK];
+    bool complete = true;
+    while (size > 0) {
+        memset(block, 0, TAR_BLOCK);
+        size_t want = size < TAR_BLOCK ? size : TAR_BLOCK;
+        size_t got = 0;
+        while (complete && got < want) {
+            ssize_t n = read(in_fd, block + got, want - got);
+            if (n <= 0)
+                complete = false;
+            else
+                got += n;
+        }
+        if (fwrite(block, 1, TAR_BLOCK, out) != TAR_BLOCK)
+            return false;
+        size -= want;
+    }
+    return complete;
+}
+
+/**
+   Write the two zero blocks that end an archive.
+ */
+bool tar_write_end(FILE *out)
+{
+    char block[2 * TAR_BLOCK];
+    memset(block, 0, sizeof block);
+    return fwrite(block, 1, sizeof block, out) == sizeof block;
+}
+
+#endif
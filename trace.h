@@ -0,0 +1,334 @@
+/*
+ *      Software License Agreement (BSD License)
+ *
+ *      Copyright (c) 2010-2011, Calvin Tee (collectskin.com)
+ *      All rights reserved.
+ *
+ *      Redistribution and use in source and binary forms, with or without
+ *      modification, are permitted provided that the following conditions are
+ *      met:
+ *
+ *      * Redistributions of source code must retain the above copyright
+ *        notice, this list of conditions and the following disclaimer.
+ *      * Redistributions in binary form must reproduce the above
+ *        copyright notice, this list of conditions and the following disclaimer
+ *        in the documentation and/or other materials provided with the
+ *        distribution.
+ *      * Neither the name of the  nor the names of its
+ *        contributors may be used to endorse or promote products derived from
+ *        this software without specific prior written permission.
+ *
+ *      THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ *      "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ *      LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ *      A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ *      OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ *      SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ *      LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ *      DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ *      THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ *      (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ *      OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/**
+   @file
+
+   Event tracing for adbFS.
+
+   Each thread records begin/end events into its own fixed-size ring
+   buffer, so tracing never allocates or blocks on other threads once
+   a thread has its ring.  When tracing is off a trace point costs a
+   single load and branch.
+
+   Tracing is toggled at runtime with SIGUSR1 and the rings are dumped
+   in Chrome trace JSON format (load in chrome://tracing or Perfetto)
+   with SIGUSR2.  Unfinished begin events in a dump show operations
+   that are still stuck.
+ */
+
+#ifndef ADBFS_TRACE_H
+#define ADBFS_TRACE_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <string>
+
+/** Events kept per thread; older events are overwritten. */
+#define TRACE_RING_SIZE 4096
+/** Bytes of path kept per event, including the terminating NUL. */
+#define TRACE_PATH_MAX 96
+
+struct traceEvent {
+    long long ts;       /* microseconds, CLOCK_MONOTONIC */
+    long long bytes;    /* byte count, or -1 if none */
+    const char *cat;
+    const char *name;
+    int tid;
+    char phase;         /* 'B', 'E' or 'i' as in the Chrome format */
+    char path[TRACE_PATH_MAX];
+};
+
+struct traceRing {
+    pthread_mutex_t lock;
+    unsigned long long head;
+    bool in_use;
+    traceRing *next;
+    traceEvent events[TRACE_RING_SIZE];
+};
+
+volatile sig_atomic_t trace_enabled = 0;
+static std::string trace_file = "/tmp/adbfs-trace.json";
+
+static pthread_mutex_t trace_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static traceRing *trace_rings = NULL;
+static pthread_key_t trace_ring_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+static __thread traceRing *trace_ring_local = NULL;
+
+/**
+   Mark the ring of an exiting thread as free for reuse.  Its events
+   are kept until a new thread overwrites them.
+ */
+static void trace_ring_release(void *arg)
+{
+    traceRing *ring = (traceRing*) arg;
+    pthread_mutex_lock(&trace_rings_lock);
+    ring->in_use = false;
+    pthread_mutex_unlock(&trace_rings_lock);
+}
+
+static void trace_key_init()
+{
+    pthread_key_create(&trace_ring_key, trace_ring_release);
+}
+
+/**
+   Return the calling thread's ring, taking a free one or allocating
+   a new one on first use.
+ */
+static traceRing *trace_ring()
+{
+    if (trace_ring_local != NULL)
+        return trace_ring_local;
+
+    pthread_once(&trace_key_once, trace_key_init);
+    pthread_mutex_lock(&trace_rings_lock);
+    traceRing *ring = trace_rings;
+    while (ring != NULL && ring->in_use)
+        ring = ring->next;
+    if (ring == NULL) {
+        ring = new traceRing;
+        pthread_mutex_init(&ring->lock, NULL);
+        ring->head = 0;
+        ring->next = trace_rings;
+        trace_rings = ring;
+    }
+    ring->in_use = true;
+    pthread_mutex_unlock(&trace_rings_lock);
+
+    pthread_setspecific(trace_ring_key, ring);
+    trace_ring_local = ring;
+    return ring;
+}
+
+static long long trace_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+   Record one event in the calling thread's ring.  Callers normally
+   check trace_enabled first; see traceScope and TRACE_INSTANT.
+
+   @param phase 'B' (begin), 'E' (end) or 'i' (instant).
+   @param cat event category; must be a string literal.
+   @param name event name; must be a string literal.
+   @param path file path the event concerns, or NULL.
+   @param bytes byte count, or -1 if not applicable.
+ */
+void trace_event(char phase, const char *cat, const char *name,
+                 const char *path, long long bytes)
+{
+    traceRing *ring = trace_ring();
+    pthread_mutex_lock(&ring->lock);
+    traceEvent &ev = ring->events[ring->head % TRACE_RING_SIZE];
+    ev.ts = trace_now();
+    ev.bytes = bytes;
+    ev.cat = cat;
+    ev.name = name;
+    ev.tid = (int) syscall(SYS_gettid);
+    ev.phase = phase;
+    if (path != NULL) {
+        strncpy(ev.path, path, TRACE_PATH_MAX - 1);
+        ev.path[TRACE_PATH_MAX - 1] = '\0';
+    } else {
+        ev.path[0] = '\0';
+    }
+    ++ring->head;
+    pthread_mutex_unlock(&ring->lock);
+}
+
+/** Record an instant event if tracing is on. */
+#define TRACE_INSTANT(cat, name, path, bytes)                 \
+    do {                                                      \
+        if (trace_enabled)                                    \
+            trace_event('i', (cat), (name), (path), (bytes)); \
+    } while (0)
+
+/**
+   Scoped begin/end event pair.  The end event carries the byte count
+   given to set_bytes, if any.  Whether the scope is traced is decided
+   once at construction, so toggling tracing never leaves a lone end
+   event.
+ */
+class traceScope {
+public:
+    traceScope(const char *cat, const char *name, const char *path)
+        : active(trace_enabled != 0), cat(cat), name(name), path(path),
+          bytes(-1)
+    {
+        if (active)
+            trace_event('B', cat, name, path, -1);
+    }
+    ~traceScope()
+    {
+        if (active)
+            trace_event('E', cat, name, path, bytes);
+    }
+    void set_bytes(long long n) { bytes = n; }
+private:
+    bool active;
+    const char *cat;
+    const char *name;
+    const char *path;
+    long long bytes;
+};
+
+/**
+   Write s to out as the body of a JSON string.
+ */
+static void trace_json_string(FILE *out, const char *s)
+{
+    for (; *s != '\0'; ++s) {
+        unsigned char c = *s;
+        if (c == '"' || c == '\\')
+            fprintf(out, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(out, "\\u%04x", c);
+        else
+            fputc(c, out);
+    }
+}
+
+/**
+   Write the contents of all rings to the given file in Chrome trace
+   JSON format.
+
+   @param filename file to (over)write.
+   @return 0 on success, -errno on failure.
+ */
+int trace_dump(const char *filename)
+{
+    FILE *out = fopen(filename, "w");
+    if (out == NULL)
+        return -errno;
+
+    int pid = getpid();
+    bool first = true;
+    fprintf(out, "{\"traceEvents\":[\n");
+    pthread_mutex_lock(&trace_rings_lock);
+    for (traceRing *ring = trace_rings; ring != NULL; ring = ring->next) {
+        pthread_mutex_lock(&ring->lock);
+        unsigned long long start = 0;
+        if (ring->head > TRACE_RING_SIZE)
+            start = ring->head - TRACE_RING_SIZE;
+        for (unsigned long long i = start; i < ring->head; ++i) {
+            const traceEvent &ev = ring->events[i % TRACE_RING_SIZE];
+            fprintf(out, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\","
+                    "\"ts\":%lld,\"pid\":%d,\"tid\":%d",
+                    first ? "" : ",\n", ev.name, ev.cat, ev.phase,
+                    ev.ts, pid, ev.tid);
+            if (ev.phase == 'i')
+                fprintf(out, ",\"s\":\"t\"");
+            fprintf(out, ",\"args\":{\"path\":\"");
+            trace_json_string(out, ev.path);
+            fprintf(out, "\"");
+            if (ev.bytes >= 0)
+                fprintf(out, ",\"bytes\":%lld", ev.bytes);
+            fprintf(out, "}}");
+            first = false;
+        }
+        pthread_mutex_unlock(&ring->lock);
+    }
+    pthread_mutex_unlock(&trace_rings_lock);
+    fprintf(out, "\n]}\n");
+
+    if (fclose(out) != 0)
+        return -errno;
+    return 0;
+}
+
+/**
+   Block the tracing control signals in the calling thread.  Call
+   before any other thread is started so that every thread inherits
+   the mask and only the control thread receives them.
+ */
+void trace_block_signals()
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+}
+
+static void *trace_control_thread(void *arg)
+{
+    (void) arg;
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGUSR1);
+    sigaddset(&set, SIGUSR2);
+    for (;;) {
+        int sig;
+        if (sigwait(&set, &sig) != 0)
+            continue;
+        if (sig == SIGUSR1) {
+            trace_enabled = !trace_enabled;
+            fprintf(stderr, "adbfs: tracing %s\n", trace_enabled ? "on" : "off");
+        } else if (sig == SIGUSR2) {
+            int res = trace_dump(trace_file.c_str());
+            if (res < 0)
+                fprintf(stderr, "adbfs: trace dump to %s failed: %s\n",
+                        trace_file.c_str(), strerror(-res));
+            else
+                fprintf(stderr, "adbfs: trace written to %s\n", trace_file.c_str());
+        }
+    }
+    return NULL;
+}
+
+/**
+   Start the thread that handles SIGUSR1 (toggle tracing) and
+   SIGUSR2 (dump to trace_file).  Must run in the process that serves
+   the filesystem, i.e. after FUSE has daemonized.
+
+   @see trace_block_signals.
+ */
+void trace_start_control()
+{
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, trace_control_thread, NULL) == 0)
+        pthread_detach(thread);
+}
+
+#endif
@@ -47,14 +47,25 @@
 #include <queue>
 #include <vector>
 #include <map>
+#include <set>
 #include <unistd.h>
+#include "trace.h"
 
 using namespace std;
 
-struct fileCache{
-    time_t timestamp;
-    queue<string> statOutput;
-};
+/**
+   Logging threshold; messages of a level above it are dropped.
+   0 is silent, 1 logs file operations, 2 also logs every command
+   run, 3 adds cache details.
+ */
+int log_verbosity = 0;
+
+/**
+   Stream for a log message of the given level, e.g.
+   @code VLOG(1) << "renaming " << from << "\n"; @endcode
+   The message is not formatted at all when it would be dropped.
+ */
+#define VLOG(level) if (log_verbosity < (level)) ; else cout
 
 queue<string> exec_command(string);
 vector<string> make_array(string);
@@ -150,21 +161,43 @@ int xtoi(const char* xs, unsigned int* result)
  */
 queue<string> exec_command(const string command)
 {
-    cout << "--*-- " << "exec_command: "  << command << "\n";
+    VLOG(2) << "--*-- " << "exec_command: "  << command << "\n";
+    traceScope trace("cmd", "exec_command", command.c_str());
     queue<string> output;
     FILE *fp = popen(command.c_str(), "r" );
 
     char buff[1000];
     string tmp_string;
+    long long bytes = 0;
     while ( fgets( buff, sizeof buff, fp ) != NULL && !feof(fp) )
     {
         tmp_string.assign(buff);
+        bytes += tmp_string.size();
         tmp_string.erase(tmp_string.size()-2);
         output.push(tmp_string);
     }
 
     pclose( fp );
 
+    trace.set_bytes(bytes);
     return output;
 }
 
+/**
+   Start the given command string as a shell command and return a
+   stream connected to its standard input (mode "w") or output (mode
+   "r"), for data that should not be collected line by line.  Close
+   it with pclose.
+
+   @param command the string to be executed as a command.
+   @param mode "r" or "w", as for popen.
+   @return the stream, or NULL if the command could not be started.
+   @see exec_command.
+ */
+FILE *exec_command_stream(const string command, const char *mode)
+{
+    VLOG(2) << "--*-- " << "exec_command_stream: "  << command << "\n";
+    TRACE_INSTANT("cmd", "exec_command_stream", command.c_str(), -1);
+    return popen(command.c_str(), mode);
+}
+